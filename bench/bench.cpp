@@ -0,0 +1,63 @@
+// decode/encode throughput on twitter, canada and citm_catalog style corpora and on the workload presets
+// build: g++ -std=c++14 -O2 bench/bench.cpp -o json_bench
+// usage: json_bench [--bytes 65536] [--warmup 3] [--trials 15] [--out report.json]
+// a human readable table goes to stderr, the json report to stdout or --out
+// on linux cycles, instructions, branch and cache misses are read per call when perf_event_open is allowed
+
+#include "harness.hpp"
+#include "corpus.hpp"
+#include "workload.hpp"
+
+// rebuilds every object of the tree through hash::operator[] and looks every key up again
+size_t rehash(const std::shared_ptr<json::value>& v) {
+    size_t n = 0;
+    for(auto& e : v->array) n += rehash(e);
+    if(v->type != "object") return n;
+    json::hash<std::shared_ptr<json::value>> h;
+    v->object.each([&](const std::string& k, const std::shared_ptr<json::value>& e) { h[k] = e; });
+    v->object.each([&](const std::string& k, const std::shared_ptr<json::value>&) { n += h.has(k); });
+    v->object.each([&](const std::string&, const std::shared_ptr<json::value>& e) { n += rehash(e); });
+    return n;
+}
+
+int main(int argc, char** argv) {
+    harness::options o = harness::parse(argc, argv);
+    perf::counters pc;
+    if(!pc.any()) std::cerr << "hardware counters unavailable, reporting wall time only" << std::endl;
+    json::hash<std::shared_ptr<json::value>> results;
+    std::vector<corpus::document> docs = corpus::standard(o.bytes);
+    for(auto& p : workload::presets(o.bytes)) docs.push_back({ p.first, workload::generate(p.second) });
+    for(auto& doc : docs) {
+        json::decoded d = json::decode(doc.text);
+        if(d.error != -1) {
+            std::cerr << doc.name << ": decode error at " << d.error << std::endl;
+            return 1;
+        }
+        std::string encoded = json::encode(d.value);
+        std::vector<std::pair<std::string, std::function<void()>>> phases = {
+            { "decode", [&] { json::decode(doc.text); } },
+            { "encode", [&] { json::encode(d.value); } },
+            { "hash",   [&] { rehash(d.value); } }
+        };
+        json::hash<std::shared_ptr<json::value>> r;
+        for(auto& p : phases) {
+            size_t bytes = p.first == "encode"? encoded.size() : doc.text.size();
+            harness::summary s = harness::summarize(harness::measure(p.second, o.warmup, o.trials));
+            harness::print(doc.name, p.first, s, bytes);
+            r[p.first] = harness::report(s, bytes);
+            if(pc.any()) {
+                bool multiplexed = false;
+                std::vector<double> median = harness::count(p.second, o.trials, pc, &multiplexed);
+                harness::print(pc, median, bytes, d.stats.nodes, multiplexed);
+                r[p.first]->object["counters"] = harness::report(pc, median, bytes, d.stats.nodes, multiplexed);
+            }
+        }
+        results[doc.name] = json::object(r);
+    }
+    harness::write(o, json::object({
+        { "benchmark", json::string("json_bench") },
+        { "warmup",    json::number(o.warmup) },
+        { "results",   json::object(results) }
+    }));
+    return 0;
+}
@@ -0,0 +1,143 @@
+// growth exponent of decode, encode and hash on adversarial shapes
+// every path is timed over doubling input sizes and t ~ n^k is fitted on a log-log scale
+// exits with 1 when a path grows faster than n log n, so it can gate a build
+// build: g++ -std=c++14 -O2 bench/complexity.cpp -o json_complexity
+// usage: json_complexity [--bytes 8192] [--trials 15] [--out report.json]
+//        --bytes is the smallest size of the sweep, the largest is 16 times that
+
+#include "harness.hpp"
+#include <cmath>
+
+struct path {
+    std::string shape;
+    std::string phase;
+    std::function<std::string(size_t)> input; // a document of about n bytes
+    std::function<void(const std::string&, const std::shared_ptr<json::value>&)> run;
+};
+
+std::string long_array(size_t n) {
+    std::string s = "[";
+    while(s.size() < n) s += "12345, ";
+    return s + "1]";
+}
+std::string nested_arrays(size_t n) { // many() used to strlen the whole input per array
+    std::string s = "[";
+    while(s.size() < n) s += "[1, 2], ";
+    return s + "[]]";
+}
+std::string wide_object(size_t n) {
+    std::string s = "{";
+    for(int i = 0; s.size() < n; i++) s += "\"key" + std::to_string(i) + "\": 1, ";
+    return s + "\"last\": 1}";
+}
+std::string colliding_keys(size_t n) { // keys whose unkeyed fnv-1a digests agree in the low 16 bits, as an attacker sends them
+    static std::vector<std::string> keys; // slow to find, kept for the larger sizes
+    static uint64_t prefix = 0;
+    std::string s = "{";
+    for(size_t i = 0; s.size() < n; i++) {
+        while(keys.size() <= i) { // a varying last byte over every prefix, a hit in about 2^16 tries
+            std::string k = "k" + std::to_string(prefix++);
+            uint64_t h = 14695981039346656037ull;
+            for(char c : k) h = (h ^ (unsigned char)c) * 1099511628211ull;
+            for(int c = '0'; c <= 'z'; c++) {
+                if(c == '\\') continue;
+                uint64_t d = (h ^ (unsigned char)c) * 1099511628211ull;
+                if(((d ^ (d >> 32)) & 0xffff) == 0) keys.push_back(k + (char)c);
+            }
+        }
+        s += "\"" + keys[i] + "\": 1, ";
+    }
+    return s + "\"last\": 1}";
+}
+std::string deep_nesting(size_t n) { // kept shallower than the byte budget, the parser recurses per level
+    size_t depth = n / 32;
+    return std::string(depth, '[') + "1" + std::string(depth, ']');
+}
+std::string long_string(size_t n) {
+    std::string s = "\"";
+    while(s.size() < n) s += "abcdefgh\\\"\\\\\\n";
+    return s + "\"";
+}
+
+void decode(const std::string& s, const std::shared_ptr<json::value>&) {
+    if(json::decode(s).error != -1) abort();
+}
+void encode(const std::string&, const std::shared_ptr<json::value>& v) {
+    json::encode(v);
+}
+void hash_build(const std::string&, const std::shared_ptr<json::value>& v) { // operator[] inserts and has() lookups
+    json::hash<std::shared_ptr<json::value>> h;
+    v->object.each([&](const std::string& k, const std::shared_ptr<json::value>& e) { h[k] = e; });
+    v->object.each([&](const std::string& k, const std::shared_ptr<json::value>&) {
+        if(!h.has(k)) abort();
+    });
+}
+
+// least squares slope of log(t) over log(n)
+double exponent(const std::vector<double>& n, const std::vector<double>& t) {
+    double mx = 0, my = 0;
+    for(size_t i = 0; i < n.size(); i++) {
+        mx += std::log(n[i]);
+        my += std::log(t[i]);
+    }
+    mx /= n.size();
+    my /= n.size();
+    double sxy = 0, sxx = 0;
+    for(size_t i = 0; i < n.size(); i++) {
+        sxy += (std::log(n[i]) - mx) * (std::log(t[i]) - my);
+        sxx += (std::log(n[i]) - mx) * (std::log(n[i]) - mx);
+    }
+    return sxy / sxx;
+}
+
+int main(int argc, char** argv) {
+    harness::options o = harness::parse(argc, argv);
+    if(o.bytes == 64 * 1024) o.bytes = 8 * 1024;
+    std::vector<path> paths = {
+        { "long_array",    "decode", long_array,    decode },
+        { "long_array",    "encode", long_array,    encode },
+        { "nested_arrays", "decode", nested_arrays, decode },
+        { "nested_arrays", "encode", nested_arrays, encode },
+        { "wide_object",   "decode", wide_object,   decode },
+        { "wide_object",   "encode", wide_object,   encode },
+        { "wide_object",   "hash",   wide_object,   hash_build },
+        { "colliding_keys", "decode", colliding_keys, decode },
+        { "colliding_keys", "hash",   colliding_keys, hash_build },
+        { "deep_nesting",  "decode", deep_nesting,  decode }, // encode indents every level, its output is quadratic by format
+        { "long_string",   "decode", long_string,   decode },
+        { "long_string",   "encode", long_string,   encode }
+    };
+    bool ok = true;
+    json::hash<std::shared_ptr<json::value>> results;
+    for(auto& p : paths) {
+        std::vector<double> sizes, times;
+        auto samples = json::array({});
+        for(size_t n = o.bytes; n <= o.bytes * 16; n *= 2) {
+            std::string s = p.input(n);
+            auto v = json::decode(s).value;
+            std::vector<double> ns = harness::measure([&] { p.run(s, v); }, o.warmup, o.trials);
+            double best = harness::summarize(ns).min; // the least disturbed run
+            sizes.push_back(s.size());
+            times.push_back(best);
+            samples->array.push_back(json::object({ { "bytes", json::number(s.size()) }, { "ns", json::number(best) } }));
+        }
+        double k = exponent(sizes, times);
+        double nlogn = 1 + std::log(std::log(sizes.back()) / std::log(sizes.front())) / std::log(sizes.back() / sizes.front());
+        double limit = nlogn + 0.15; // allowance for timer and cache noise
+        bool pass = k <= limit;
+        ok = ok && pass;
+        fprintf(stderr, "%-14s %-7s exponent %5.2f  limit %5.2f  %s\n", p.shape.c_str(), p.phase.c_str(), k, limit, pass? "ok" : "FAIL");
+        results[p.shape + "." + p.phase] = json::object({
+            { "exponent", json::number(k) },
+            { "limit",    json::number(limit) },
+            { "pass",     json::boolean(pass) },
+            { "samples",  samples }
+        });
+    }
+    harness::write(o, json::object({
+        { "benchmark", json::string("json_complexity") },
+        { "pass",      json::boolean(ok) },
+        { "results",   json::object(results) }
+    }));
+    return ok? 0 : 1;
+}
@@ -0,0 +1,149 @@
+// in-tree generators for twitter.json, canada.json and citm_catalog.json style documents
+// the output is deterministic so every version of json.hpp is measured on the same bytes
+// the grammar has no null, no negative numbers and no exponents, so the corpora avoid them
+
+#ifndef JSON_BENCH_CORPUS_HPP
+#define JSON_BENCH_CORPUS_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+
+namespace corpus {
+    struct rng { // xorshift64*, same sequence on every platform
+        uint64_t s;
+        rng(uint64_t seed) : s(seed * 2685821657736338717ull + 1) {}
+        uint64_t next() {
+            s ^= s >> 12;
+            s ^= s << 25;
+            s ^= s >> 27;
+            return s * 2685821657736338717ull;
+        }
+        int range(int lo, int hi) { return lo + (int)(next() % (uint64_t)(hi - lo + 1)); }
+        double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    };
+
+    struct document {
+        std::string name;
+        std::string text;
+    };
+
+    std::string word(rng& r) {
+        static const char* words[] = {
+            "lorem", "ipsum", "dolor", "sit", "amet", "json", "tweet", "caf\xc3\xa9", "na\xc3\xafve", "\xe6\x9d\xb1\xe4\xba\xac",
+            "rt", "@user", "#tag", "http://t.co/x1", "\\\"quoted\\\"", "line\\nbreak", "\\u00e9t\\u00e9", "the", "of", "and"
+        };
+        return words[r.range(0, 19)];
+    }
+    std::string sentence(rng& r, int words) {
+        std::string s;
+        for(int i = 0; i < words; i++) {
+            if(i) s += " ";
+            s += word(r);
+        }
+        return s;
+    }
+    std::string digits(rng& r, int n) {
+        std::string s(1, (char)('1' + r.range(0, 8)));
+        for(int i = 1; i < n; i++) s += (char)('0' + r.range(0, 9));
+        return s;
+    }
+    std::string decimal(rng& r, double lo, double hi, int places) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.*f", places, lo + (hi - lo) * r.unit());
+        return buf;
+    }
+
+    // many small objects with nested users, short strings and lots of escapes
+    document twitter(size_t bytes, uint64_t seed = 1) {
+        rng r(seed);
+        std::string s = "{\n    \"statuses\": [\n";
+        for(int i = 0; s.size() < bytes; i++) {
+            if(i) s += ",\n";
+            std::string id = digits(r, 18);
+            s += "        {\n";
+            s += "            \"created_at\": \"Sun Aug 31 00:29:15 +0000 2014\",\n";
+            s += "            \"id\": " + id + ",\n";
+            s += "            \"id_str\": \"" + id + "\",\n";
+            s += "            \"text\": \"" + sentence(r, r.range(4, 20)) + "\",\n";
+            s += "            \"source\": \"<a href=\\\"https://mobile.twitter.com\\\" rel=\\\"nofollow\\\">Mobile Web</a>\",\n";
+            s += "            \"truncated\": false,\n";
+            s += "            \"user\": {\n";
+            s += "                \"id\": " + digits(r, 10) + ",\n";
+            s += "                \"name\": \"" + sentence(r, 2) + "\",\n";
+            s += "                \"screen_name\": \"" + word(r) + digits(r, 3) + "\",\n";
+            s += "                \"description\": \"" + sentence(r, r.range(0, 12)) + "\",\n";
+            s += "                \"followers_count\": " + digits(r, r.range(1, 6)) + ",\n";
+            s += "                \"verified\": " + std::string(r.range(0, 9) == 0? "true" : "false") + "\n";
+            s += "            },\n";
+            s += "            \"entities\": {\n";
+            s += "                \"hashtags\": [";
+            int tags = r.range(0, 3);
+            for(int t = 0; t < tags; t++) {
+                s += std::string(t? ", " : "") + "{ \"text\": \"" + word(r) + "\", \"indices\": [" + std::to_string(r.range(0, 60)) + ", " + std::to_string(r.range(61, 140)) + "] }";
+            }
+            s += "],\n";
+            s += "                \"urls\": []\n";
+            s += "            },\n";
+            s += "            \"retweet_count\": " + digits(r, r.range(1, 4)) + ",\n";
+            s += "            \"favorite_count\": " + digits(r, r.range(1, 3)) + ",\n";
+            s += "            \"favorited\": false,\n";
+            s += "            \"lang\": \"ja\"\n";
+            s += "        }";
+        }
+        s += "\n    ],\n    \"search_metadata\": { \"completed_in\": 0.087, \"count\": 100, \"query\": \"%E4%B8%80\" }\n}\n";
+        return { "twitter", s };
+    }
+
+    // few large arrays of coordinate pairs with long decimals
+    document canada(size_t bytes, uint64_t seed = 2) {
+        rng r(seed);
+        std::string s = "{\"type\":\"FeatureCollection\",\"features\":[{\"type\":\"Feature\",\"properties\":{\"name\":\"Canada\"},\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[\n";
+        for(int ring = 0; s.size() < bytes; ring++) {
+            if(ring) s += ",";
+            s += "[";
+            int points = r.range(50, 400);
+            for(int p = 0; p < points && s.size() < bytes; p++) {
+                if(p) s += ",";
+                s += "[" + decimal(r, 52, 141, 15) + "," + decimal(r, 41, 83, 15) + "]";
+            }
+            s += "]\n";
+        }
+        s += "]}}]}\n";
+        return { "canada", s };
+    }
+
+    // objects keyed by numeric ids, nested price arrays and integer heavy records
+    document citm_catalog(size_t bytes, uint64_t seed = 3) {
+        rng r(seed);
+        std::string s = "{\n\t\"areaNames\": {\n";
+        for(int i = 0; i < 17; i++) {
+            s += std::string(i? ",\n" : "") + "\t\t\"" + digits(r, 9) + "\": \"" + sentence(r, r.range(1, 3)) + "\"";
+        }
+        s += "\n\t},\n\t\"audienceSubCategoryNames\": {\n\t\t\"337100890\": \"Abonn\\u00e9\"\n\t},\n\t\"performances\": [\n";
+        for(int i = 0; s.size() < bytes; i++) {
+            if(i) s += ",\n";
+            s += "\t\t{\n\t\t\t\"eventId\": " + digits(r, 9) + ",\n\t\t\t\"id\": " + digits(r, 9) + ",\n";
+            s += "\t\t\t\"logo\": \"/images/UE0AAAAACEKo6QAAAAZDSVRN\",\n\t\t\t\"prices\": [\n";
+            int prices = r.range(1, 6);
+            for(int p = 0; p < prices; p++) {
+                s += std::string(p? ",\n" : "") + "\t\t\t\t{\n\t\t\t\t\t\"amount\": " + digits(r, 5) + ",\n\t\t\t\t\t\"audienceSubCategoryId\": 337100890,\n\t\t\t\t\t\"seatCategoryId\": " + digits(r, 9) + "\n\t\t\t\t}";
+            }
+            s += "\n\t\t\t],\n\t\t\t\"seatCategories\": [\n";
+            int cats = r.range(1, 4);
+            for(int c = 0; c < cats; c++) {
+                s += std::string(c? ",\n" : "") + "\t\t\t\t{\n\t\t\t\t\t\"areas\": [ { \"areaId\": " + digits(r, 9) + ", \"blockIds\": [] }, { \"areaId\": " + digits(r, 9) + ", \"blockIds\": [] } ],\n\t\t\t\t\t\"seatCategoryId\": " + digits(r, 9) + "\n\t\t\t\t}";
+            }
+            s += "\n\t\t\t],\n\t\t\t\"start\": " + digits(r, 13) + ",\n\t\t\t\"venueCode\": \"PLEYEL_PLEYEL\"\n\t\t}";
+        }
+        s += "\n\t],\n\t\"venueNames\": {\n\t\t\"PLEYEL_PLEYEL\": \"Salle Pleyel\"\n\t}\n}\n";
+        return { "citm_catalog", s };
+    }
+
+    std::vector<document> standard(size_t bytes) {
+        return { twitter(bytes), canada(bytes), citm_catalog(bytes) };
+    }
+};
+
+#endif
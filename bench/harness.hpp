@@ -0,0 +1,149 @@
+// shared measurement helpers for the benchmark executables
+// every trial is timed on its own, results are summarized as percentiles and written with json::encode_line,
+// which keeps every digit of the counts where json::encode rounds to six
+
+#ifndef JSON_BENCH_HARNESS_HPP
+#define JSON_BENCH_HARNESS_HPP
+
+#include "../json.hpp"
+#include "perf.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+
+namespace harness {
+    typedef std::chrono::steady_clock clock;
+
+    struct options {
+        int warmup = 3;
+        int trials = 15;
+        size_t bytes = 64 * 1024;
+        std::string out; // json report path, stdout when empty
+        std::string corpus; // input file of the benchmarks that replay one
+        int threads = 0;    // most threads of the scaling benchmarks, 0 for the hardware concurrency
+        int millis = 200;   // run time of each timed run of the scaling benchmarks
+    };
+    options parse(int argc, char** argv) {
+        options o;
+        for(int i = 1; i + 1 < argc; i += 2) {
+            std::string a = argv[i];
+            if(a == "--warmup") o.warmup = atoi(argv[i + 1]);
+            else if(a == "--trials") o.trials = atoi(argv[i + 1]);
+            else if(a == "--bytes") o.bytes = strtoull(argv[i + 1], nullptr, 10);
+            else if(a == "--out") o.out = argv[i + 1];
+            else if(a == "--corpus") o.corpus = argv[i + 1];
+            else if(a == "--threads") o.threads = atoi(argv[i + 1]);
+            else if(a == "--millis") o.millis = atoi(argv[i + 1]);
+            else {
+                std::cerr << "unknown option " << a << std::endl;
+                exit(2);
+            }
+        }
+        if(o.trials < 1) o.trials = 1;
+        return o;
+    }
+
+    struct summary {
+        int trials;
+        double min, p50, p90, p99, max, mean; // nanoseconds per call
+    };
+    double percentile(const std::vector<double>& sorted, double p) { // nearest rank
+        size_t i = (size_t)(p / 100 * sorted.size());
+        return sorted[std::min(i, sorted.size() - 1)];
+    }
+    summary summarize(std::vector<double> ns) {
+        std::sort(ns.begin(), ns.end());
+        double sum = 0;
+        for(double e : ns) sum += e;
+        return { (int)ns.size(), ns.front(), percentile(ns, 50), percentile(ns, 90), percentile(ns, 99), ns.back(), sum / ns.size() };
+    }
+
+    template <typename F>
+    std::vector<double> measure(F f, int warmup, int trials) {
+        for(int i = 0; i < warmup; i++) f();
+        std::vector<double> ns;
+        for(int i = 0; i < trials; i++) {
+            auto t = clock::now();
+            f();
+            ns.push_back(std::chrono::duration<double, std::nano>(clock::now() - t).count());
+        }
+        return ns;
+    }
+
+    // median hardware counter readings per call, -1 for the events that are not available
+    // run apart from measure() so the counter syscalls do not show up in the wall times,
+    // multiplexed is set when the kernel time-shared the counters in any trial and the readings were scaled
+    template <typename F>
+    std::vector<double> count(F f, int trials, perf::counters& pc, bool* multiplexed = nullptr) {
+        std::vector<std::vector<double>> readings(pc.size());
+        if(multiplexed) *multiplexed = false;
+        for(int i = 0; i < trials; i++) {
+            pc.start();
+            f();
+            std::vector<double> r = pc.stop();
+            if(multiplexed) *multiplexed = *multiplexed || pc.multiplexed();
+            for(size_t e = 0; e < r.size(); e++) readings[e].push_back(r[e]);
+        }
+        std::vector<double> median;
+        for(auto& r : readings) {
+            std::sort(r.begin(), r.end());
+            median.push_back(r.empty()? -1 : percentile(r, 50));
+        }
+        return median;
+    }
+    std::shared_ptr<json::value> report(const perf::counters& pc, const std::vector<double>& median, size_t bytes, size_t nodes, bool multiplexed = false) {
+        json::hash<std::shared_ptr<json::value>> h;
+        double cycles = -1, instructions = -1;
+        for(size_t e = 0; e < pc.size(); e++) {
+            if(median[e] < 0) continue;
+            if(pc.name(e) == "cycles") cycles = median[e];
+            if(pc.name(e) == "instructions") instructions = median[e];
+            h[pc.name(e)] = json::object({
+                { "per_call", json::number(median[e]) },
+                { "per_byte", json::number(median[e] / bytes) },
+                { "per_node", json::number(median[e] / nodes) }
+            });
+        }
+        if(cycles > 0 && instructions >= 0) h["ipc"] = json::number(instructions / cycles);
+        h["multiplexed"] = json::boolean(multiplexed); // the counts are estimates
+        return json::object(h);
+    }
+    void print(const perf::counters& pc, const std::vector<double>& median, size_t bytes, size_t nodes, bool multiplexed = false) {
+        fprintf(stderr, "%23s", "");
+        for(size_t e = 0; e < pc.size(); e++) {
+            if(median[e] >= 0) fprintf(stderr, "  %s %.2f/B %.1f/node", pc.name(e).c_str(), median[e] / bytes, median[e] / nodes);
+        }
+        fprintf(stderr, multiplexed? "  (multiplexed, scaled)\n" : "\n");
+    }
+
+    std::shared_ptr<json::value> report(const summary& s, size_t bytes) { // throughput is computed from the median
+        return json::object({
+            { "bytes",          json::number(bytes) },
+            { "trials",         json::number(s.trials) },
+            { "ns_min",         json::number(s.min) },
+            { "ns_p50",         json::number(s.p50) },
+            { "ns_p90",         json::number(s.p90) },
+            { "ns_p99",         json::number(s.p99) },
+            { "ns_max",         json::number(s.max) },
+            { "ns_mean",        json::number(s.mean) },
+            { "mb_per_s",       json::number(bytes / s.p50 * 1e9 / (1024 * 1024)) },
+            { "docs_per_s",     json::number(1e9 / s.p50) },
+            { "ns_per_byte",    json::number(s.p50 / bytes) }
+        });
+    }
+    void print(const std::string& name, const std::string& phase, const summary& s, size_t bytes) {
+        fprintf(stderr, "%-14s %-7s %10zu B  p50 %12.0f ns  p90 %12.0f ns  p99 %12.0f ns  %8.2f MB/s  %8.2f ns/B\n",
+            name.c_str(), phase.c_str(), bytes, s.p50, s.p90, s.p99, bytes / s.p50 * 1e9 / (1024 * 1024), s.p50 / bytes);
+    }
+    void write(const options& o, const std::shared_ptr<json::value>& v) {
+        if(o.out.empty()) {
+            std::cout << json::encode_line(v) << std::endl;
+            return;
+        }
+        std::ofstream f(o.out);
+        f << json::encode_line(v) << "\n";
+    }
+};
+
+#endif
@@ -0,0 +1,86 @@
+// where decode spends its time within a document, by json pointer with array indices collapsed to *
+// writes folded stacks for flamegraph.pl and prints the heaviest paths to stderr
+// build: g++ -std=c++14 -O2 bench/paths.cpp -o json_paths
+//        add -DJSON_ALLOC_STATS to attribute allocations too
+// usage: json_paths [--file doc.json | --corpus twitter|canada|citm_catalog] [--bytes 65536] [--trials 5]
+//                   [--weight ticks|scan_ticks|build_ticks|nodes|bytes|allocs|allocated] [--top 20] [--out doc.folded]
+//        flamegraph.pl doc.folded > doc.svg
+
+#include "../json.hpp"
+#include "corpus.hpp"
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+int main(int argc, char** argv) {
+    std::string file, name = "twitter", weight = "ticks", out;
+    size_t bytes = 64 * 1024, top = 20;
+    int trials = 5;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        std::string a = argv[i];
+        const char* v = argv[i + 1];
+        if(a == "--file") file = v;
+        else if(a == "--corpus") name = v;
+        else if(a == "--bytes") bytes = strtoull(v, nullptr, 10);
+        else if(a == "--trials") trials = atoi(v);
+        else if(a == "--weight") weight = v;
+        else if(a == "--top") top = strtoull(v, nullptr, 10);
+        else if(a == "--out") out = v;
+        else {
+            std::cerr << "unknown option " << a << std::endl;
+            return 2;
+        }
+    }
+    std::string text;
+    if(!file.empty()) {
+        std::ifstream f(file, std::ios::binary);
+        if(!f) {
+            std::cerr << "cannot read " << file << std::endl;
+            return 2;
+        }
+        std::stringstream ss;
+        ss << f.rdbuf();
+        text = ss.str();
+    }
+    else {
+        for(auto& d : corpus::standard(bytes)) {
+            if(d.name == name) text = d.text;
+        }
+        if(text.empty()) {
+            std::cerr << "unknown corpus " << name << std::endl;
+            return 2;
+        }
+    }
+    json::path_profile p; // summed over the trials, which evens out timer noise on small paths
+    for(int t = 0; t < trials; t++) {
+        json::decoded d = json::decode_profiled(text, p);
+        if(d.error != -1) {
+            std::cerr << "decode error at byte " << d.error << std::endl;
+            return 1;
+        }
+    }
+    std::string folded = p.folded(weight);
+    if(out.empty()) {
+        std::cout << folded;
+    }
+    else {
+        std::ofstream f(out, std::ios::binary);
+        f << folded;
+    }
+    std::vector<std::pair<std::string, json::path_profile::entry>> rows = p.paths;
+    auto ticks = [](const json::path_profile::entry& e) { return e.scan_ticks + e.build_ticks; };
+    std::sort(rows.begin(), rows.end(), [&](auto& a, auto& b) { return ticks(a.second) > ticks(b.second); });
+    uint64_t all = 0;
+    for(auto& e : rows) all += ticks(e.second);
+    std::cerr << std::left << std::setw(48) << "path" << std::right << std::setw(10) << "nodes" << std::setw(12) << "bytes"
+              << std::setw(14) << "scan ticks" << std::setw(14) << "build ticks" << std::setw(10) << "allocs" << std::setw(8) << "self%" << std::endl;
+    for(size_t i = 0; i < rows.size() && i < top; i++) {
+        const json::path_profile::entry& e = rows[i].second;
+        std::cerr << std::left << std::setw(48) << (rows[i].first.empty()? "(root)" : rows[i].first) << std::right
+                  << std::setw(10) << e.nodes / trials << std::setw(12) << e.bytes / trials
+                  << std::setw(14) << e.scan_ticks / trials << std::setw(14) << e.build_ticks / trials << std::setw(10) << e.allocs / trials
+                  << std::setw(7) << std::fixed << std::setprecision(1) << (all? 100.0 * ticks(e) / all : 0) << "%" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+// hardware performance counters around a measured call, through linux perf_event_open
+// the events are opened as one group so the kernel schedules them together and ratios such as ipc compare the
+// same instructions, an event that cannot join the group is opened on its own and a missing one only drops that event;
+// when the kernel still multiplexes, readings are scaled by the time enabled over the time running and flagged
+// on other systems or when perf_event_paranoid or a container forbids it nothing is available and the benchmarks
+// report wall time only
+
+#ifndef JSON_BENCH_PERF_HPP
+#define JSON_BENCH_PERF_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace perf {
+    struct event {
+        std::string name;
+        uint32_t type;
+        uint64_t config;
+    };
+    std::vector<event> events() {
+    #ifdef __linux__
+        auto cache = [](uint64_t id) {
+            return id | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+        return {
+            { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+            { "l1d_misses",    PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_L1D) },
+            { "llc_misses",    PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL) }
+        };
+    #else
+        return {};
+    #endif
+    }
+
+    class counters {
+        std::vector<event> ev;
+        std::vector<int> fd; // -1 for an event that could not be opened
+        std::vector<bool> member; // started and stopped with the leader
+        std::vector<uint64_t> enabled, running; // totals at the last stop(), reset does not clear them
+        int leader = -1;
+        bool scaled = false;
+    #ifdef __linux__
+        static int open(const event& e, int group) {
+            perf_event_attr a = {};
+            a.size = sizeof(a);
+            a.type = e.type;
+            a.config = e.config;
+            a.disabled = group == -1; // members count while their leader does
+            a.exclude_kernel = 1;
+            a.exclude_hv = 1;
+            a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            return (int)syscall(SYS_perf_event_open, &a, 0, -1, group, 0);
+        }
+        void control(unsigned long request) {
+            if(leader != -1) ioctl(leader, request, PERF_IOC_FLAG_GROUP);
+            for(size_t i = 0; i < fd.size(); i++) {
+                if(fd[i] != -1 && !member[i] && fd[i] != leader) ioctl(fd[i], request, 0);
+            }
+        }
+    #endif
+        public:
+            counters() : ev(events()) {
+                for(auto& e : ev) {
+                    int f = -1;
+                    bool m = false;
+                #ifdef __linux__
+                    if(leader != -1) {
+                        f = open(e, leader);
+                        m = f != -1;
+                    }
+                    if(f == -1) f = open(e, -1);
+                    if(f != -1 && leader == -1) leader = f;
+                #endif
+                    fd.push_back(f);
+                    member.push_back(m);
+                    enabled.push_back(0);
+                    running.push_back(0);
+                }
+            }
+            ~counters() {
+            #ifdef __linux__
+                for(int f : fd) if(f != -1) close(f);
+            #endif
+            }
+            counters(const counters&) = delete;
+            counters& operator = (const counters&) = delete;
+            size_t size() const { return ev.size(); }
+            const std::string& name(size_t i) const { return ev[i].name; }
+            bool available(size_t i) const { return fd[i] != -1; }
+            bool any() const {
+                for(int f : fd) if(f != -1) return true;
+                return false;
+            }
+            bool multiplexed() const { return scaled; } // some reading of the last stop() was scaled
+            void start() {
+            #ifdef __linux__
+                control(PERF_EVENT_IOC_RESET);
+                control(PERF_EVENT_IOC_ENABLE);
+            #endif
+            }
+            std::vector<double> stop() { // one reading per event, -1 when unavailable or never scheduled
+                std::vector<double> r;
+                scaled = false;
+            #ifdef __linux__
+                control(PERF_EVENT_IOC_DISABLE);
+            #endif
+                uint64_t group[2] = {}; // the times of the leader, members are scheduled with it
+                for(size_t i = 0; i < fd.size(); i++) {
+                    double v = -1;
+                #ifdef __linux__
+                    uint64_t n[3] = {}; // value, time enabled, time running
+                    if(fd[i] != -1 && read(fd[i], n, sizeof(n)) == sizeof(n)) {
+                        uint64_t e = n[1] - enabled[i], g = n[2] - running[i];
+                        enabled[i] = n[1];
+                        running[i] = n[2];
+                        if(fd[i] == leader) {
+                            group[0] = e;
+                            group[1] = g;
+                        }
+                        if(member[i]) { // they stay enabled between trials while the leader is not, their own times overstate it
+                            e = group[0];
+                            g = group[1];
+                        }
+                        if(g > 0) {
+                            v = (double)n[0];
+                            if(g < e) {
+                                v *= (double)e / g;
+                                scaled = true;
+                            }
+                        }
+                    }
+                #endif
+                    r.push_back(v);
+                }
+                return r;
+            }
+    };
+};
+
+#endif
@@ -0,0 +1,95 @@
+// replays a corpus written by json::capture through decode, encode and a round trip
+// build: g++ -std=c++14 -O2 bench/replay.cpp -o json_replay
+// usage: json_replay --corpus captured.bin [--warmup 1] [--trials 5] [--out report.json]
+// throughput is total bytes over total time, latencies are per record over every trial
+
+#include "harness.hpp"
+#include <fstream>
+#include <sstream>
+
+std::vector<std::string> read(const std::string& path) { // length, newline, bytes, newline
+    std::ifstream f(path, std::ios::binary);
+    std::vector<std::string> records;
+    size_t n;
+    while(f >> n) {
+        f.get();
+        std::string r(n, '\0');
+        if(!f.read(&r[0], n)) break; // a torn last record
+        f.get();
+        records.push_back(r);
+    }
+    return records;
+}
+
+int main(int argc, char** argv) {
+    harness::options o = harness::parse(argc, argv);
+    if(o.corpus.empty()) {
+        std::cerr << "--corpus is required" << std::endl;
+        return 2;
+    }
+    if(o.trials == 15) o.trials = 5;
+    std::vector<std::string> records = read(o.corpus);
+    std::vector<std::string> inputs;
+    std::vector<std::shared_ptr<json::value>> values;
+    size_t bytes = 0, failed = 0;
+    for(auto& r : records) {
+        json::decoded d = json::decode(r);
+        if(d.error != -1) {
+            failed++;
+            continue;
+        }
+        inputs.push_back(r);
+        values.push_back(d.value);
+        bytes += r.size();
+    }
+    fprintf(stderr, "%zu records, %zu bytes, %zu do not decode and are left out\n", records.size(), bytes, failed);
+    if(values.empty()) return 1;
+    size_t roundtrip_failed = 0;
+    for(auto& v : values) if(json::decode(json::encode(v)).error != -1) roundtrip_failed++;
+    std::vector<std::pair<std::string, std::function<void(size_t)>>> phases = {
+        { "decode",    [&](size_t i) { json::decode(inputs[i]); } },
+        { "encode",    [&](size_t i) { json::encode(values[i]); } },
+        { "roundtrip", [&](size_t i) { json::decode(json::encode(json::decode(inputs[i]).value)); } }
+    };
+    json::hash<std::shared_ptr<json::value>> results;
+    for(auto& p : phases) {
+        for(int w = 0; w < o.warmup; w++) {
+            for(size_t i = 0; i < inputs.size(); i++) p.second(i);
+        }
+        std::vector<double> ns;
+        double total = 0;
+        for(int t = 0; t < o.trials; t++) {
+            for(size_t i = 0; i < inputs.size(); i++) {
+                auto s = harness::clock::now();
+                p.second(i);
+                double e = std::chrono::duration<double, std::nano>(harness::clock::now() - s).count();
+                ns.push_back(e);
+                total += e;
+            }
+        }
+        std::sort(ns.begin(), ns.end());
+        harness::summary s = harness::summarize(ns);
+        double mbs = (double)bytes * o.trials / total * 1e9 / (1024 * 1024);
+        fprintf(stderr, "%-10s %8.2f MB/s  p50 %10.0f ns  p99 %10.0f ns  p99.9 %10.0f ns  max %10.0f ns\n",
+            p.first.c_str(), mbs, s.p50, s.p99, harness::percentile(ns, 99.9), s.max);
+        results[p.first] = json::object({
+            { "mb_per_s",    json::number(mbs) },
+            { "records_per_s", json::number(inputs.size() * o.trials / total * 1e9) },
+            { "ns_p50",      json::number(s.p50) },
+            { "ns_p90",      json::number(s.p90) },
+            { "ns_p99",      json::number(s.p99) },
+            { "ns_p999",     json::number(harness::percentile(ns, 99.9)) },
+            { "ns_max",      json::number(s.max) }
+        });
+    }
+    harness::write(o, json::object({
+        { "benchmark",        json::string("json_replay") },
+        { "corpus",           json::string(o.corpus) },
+        { "records",          json::number(inputs.size()) },
+        { "bytes",            json::number(bytes) },
+        { "undecodable",      json::number(failed) },
+        { "roundtrip_failed", json::number(roundtrip_failed) },
+        { "results",          json::object(results) }
+    }));
+    return 0;
+}
@@ -0,0 +1,141 @@
+// decode, encode and traversal throughput on 1..N threads, over one shared document and over a document per thread
+// build: g++ -std=c++14 -O2 -pthread bench/threads.cpp -o json_threads
+// usage: json_threads [--threads N] [--millis 200] [--bytes 16384] [--out report.json]
+// contention is attributed by comparing modes that differ in one shared resource, as lost scaling efficiency:
+//   baseline        traverse_shared_ref only reads, what it loses is the machine itself (cores, smt, bandwidth)
+//   refcounts       traverse_shared_copy against traverse_own_copy, both copy shared_ptrs but only one shares them
+//   malloc          alloc_churn against the baseline, it allocates and frees value and ast sized blocks and nothing else
+//   parser globals  parse_only against alloc_churn, parsing is allocation plus reading the global parser:: rules
+
+#include "harness.hpp"
+#include "corpus.hpp"
+#include <thread>
+#include <atomic>
+#include <map>
+
+size_t walk_copy(std::shared_ptr<json::value> v) { // every child copy touches the shared refcount
+    size_t n = 1;
+    for(auto e : v->array) n += walk_copy(e);
+    v->object.each([&](const std::string&, std::shared_ptr<json::value> e) { n += walk_copy(e); });
+    return n;
+}
+size_t walk_ref(const json::value& v) {
+    size_t n = 1;
+    for(auto& e : v.array) n += walk_ref(*e);
+    v.object.each([&](const std::string&, const std::shared_ptr<json::value>& e) { n += walk_ref(*e); });
+    return n;
+}
+
+struct run {
+    double ops_per_s;
+    harness::summary latency;
+};
+
+// every thread repeats op(thread) for the given time, the threads start together
+run measure(int threads, int millis, const std::function<void(int)>& op) {
+    std::atomic<int> ready{ 0 };
+    std::atomic<bool> go{ false };
+    std::vector<std::vector<double>> ns(threads);
+    std::vector<std::thread> pool;
+    for(int t = 0; t < threads; t++) {
+        pool.emplace_back([&, t] {
+            ready++;
+            while(!go) std::this_thread::yield();
+            auto end = harness::clock::now() + std::chrono::milliseconds(millis);
+            for(;;) {
+                auto s = harness::clock::now();
+                if(s >= end) break;
+                op(t);
+                ns[t].push_back(std::chrono::duration<double, std::nano>(harness::clock::now() - s).count());
+            }
+        });
+    }
+    while(ready < threads) std::this_thread::yield();
+    go = true;
+    for(auto& e : pool) e.join();
+    std::vector<double> all;
+    for(auto& e : ns) all.insert(all.end(), e.begin(), e.end());
+    if(all.empty()) all.push_back(millis * 1e6);
+    return { all.size() / (millis / 1000.0), harness::summarize(all) };
+}
+
+int main(int argc, char** argv) {
+    harness::options o = harness::parse(argc, argv);
+    if(o.bytes == 64 * 1024) o.bytes = 16 * 1024;
+    int most = o.threads > 0? o.threads : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> counts;
+    for(int n = 1; n < most; n *= 2) counts.push_back(n);
+    counts.push_back(most);
+
+    std::string text = corpus::twitter(o.bytes).text;
+    std::shared_ptr<json::value> shared = json::decode(text).value;
+    std::vector<std::shared_ptr<json::value>> own;
+    std::vector<std::string> texts;
+    for(int t = 0; t < most; t++) {
+        texts.push_back(std::string(text.begin(), text.end())); // a separate buffer per thread
+        own.push_back(json::decode(texts.back()).value);
+    }
+    size_t value_block = sizeof(json::value) + 16, ast_block = sizeof(json_internals::ast) + 16;
+    size_t nodes = json::decode(text).stats.nodes;
+
+    std::vector<std::pair<std::string, std::function<void(int)>>> modes = {
+        { "decode_independent",   [&](int t) { json::decode(texts[t]); } },
+        { "decode_shared_input",  [&](int) { json::decode(text); } },
+        { "encode_shared",        [&](int) { json::encode(shared); } },
+        { "encode_independent",   [&](int t) { json::encode(own[t]); } },
+        { "traverse_shared_copy", [&](int) { walk_copy(shared); } },
+        { "traverse_shared_ref",  [&](int) { walk_ref(*shared); } },
+        { "traverse_own_copy",    [&](int t) { walk_copy(own[t]); } },
+        { "parse_only",           [&](int t) { json_internals::parser::element(texts[t].c_str(), 0); } },
+        { "alloc_churn",          [&](int) { // the block sizes and counts of one decode
+            std::vector<void*> blocks;
+            blocks.reserve(nodes * 8);
+            for(size_t i = 0; i < nodes; i++) blocks.push_back(::operator new(value_block));
+            for(size_t i = 0; i < nodes * 6; i++) blocks.push_back(::operator new(ast_block));
+            for(void* b : blocks) ::operator delete(b);
+        } }
+    };
+
+    json::hash<std::shared_ptr<json::value>> results;
+    std::map<std::string, double> efficiency; // at the most threads
+    for(auto& m : modes) {
+        auto rows = json::array({});
+        double single = 0;
+        for(int n : counts) {
+            run r = measure(n, o.millis, m.second);
+            if(n == 1) single = r.ops_per_s;
+            double eff = r.ops_per_s / (n * single);
+            efficiency[m.first] = eff;
+            fprintf(stderr, "%-22s %3d threads %12.1f ops/s  efficiency %5.2f  p50 %10.0f ns  p99 %10.0f ns\n",
+                m.first.c_str(), n, r.ops_per_s, eff, r.latency.p50, r.latency.p99);
+            rows->array.push_back(json::object({
+                { "threads",    json::number(n) },
+                { "ops_per_s",  json::number(r.ops_per_s) },
+                { "efficiency", json::number(eff) },
+                { "ns_p50",     json::number(r.latency.p50) },
+                { "ns_p99",     json::number(r.latency.p99) },
+                { "ns_max",     json::number(r.latency.max) }
+            }));
+        }
+        results[m.first] = rows;
+    }
+    // lost efficiency explained by each shared resource, at the most threads
+    double baseline = 1 - efficiency["traverse_shared_ref"];
+    double refcounts = efficiency["traverse_own_copy"] - efficiency["traverse_shared_copy"];
+    double malloc = efficiency["traverse_shared_ref"] - efficiency["alloc_churn"];
+    double parser = efficiency["alloc_churn"] - efficiency["parse_only"];
+    if(most > (int)std::thread::hardware_concurrency()) fprintf(stderr, "more threads than cores, the baseline absorbs the oversubscription\n");
+    fprintf(stderr, "efficiency lost at %d threads: baseline %.2f  refcounts %.2f  malloc %.2f  parser globals %.2f\n", most, baseline, refcounts, malloc, parser);
+    harness::write(o, json::object({
+        { "benchmark",   json::string("json_threads") },
+        { "threads",     json::number(most) },
+        { "results",     json::object(results) },
+        { "attribution", json::object({
+            { "baseline",       json::number(baseline) },
+            { "refcounts",      json::number(refcounts) },
+            { "malloc",         json::number(malloc) },
+            { "parser_globals", json::number(parser) }
+        }) }
+    }));
+    return 0;
+}
@@ -0,0 +1,55 @@
+// writes a synthetic document of a controlled shape to stdout
+// build: g++ -std=c++14 -O2 bench/workload.cpp -o json_workload
+// usage: json_workload [--preset mixed|wide|deep|strings|numbers] [--seed 1] [--depth 4] [--fanout-min 2] [--fanout-max 8]
+//                      [--keys 64] [--string-min 0] [--string-max 32] [--string-geometric 0|1] [--numbers 0.3]
+//                      [--booleans 0.1] [--objects 0.5] [--escapes 0.02] [--whitespace compact|spaced|pretty] [--bytes 65536]
+// options apply in order, so a preset can be adjusted by the options after it
+
+#include "workload.hpp"
+#include <iostream>
+#include <cstdlib>
+
+int main(int argc, char** argv) {
+    workload::shape sh;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        std::string a = argv[i];
+        const char* v = argv[i + 1];
+        if(a == "--preset") {
+            bool found = false;
+            for(auto& p : workload::presets(sh.bytes)) {
+                if(p.first == v) {
+                    sh = p.second;
+                    found = true;
+                }
+            }
+            if(!found) {
+                std::cerr << "unknown preset " << v << std::endl;
+                return 2;
+            }
+        }
+        else if(a == "--seed") sh.seed = strtoull(v, nullptr, 10);
+        else if(a == "--depth") sh.depth = atoi(v);
+        else if(a == "--fanout-min") sh.fanout_min = atoi(v);
+        else if(a == "--fanout-max") sh.fanout_max = atoi(v);
+        else if(a == "--keys") sh.keys = atoi(v);
+        else if(a == "--string-min") sh.string_min = atoi(v);
+        else if(a == "--string-max") sh.string_max = atoi(v);
+        else if(a == "--string-geometric") sh.string_geometric = atoi(v) != 0;
+        else if(a == "--numbers") sh.numbers = atof(v);
+        else if(a == "--booleans") sh.booleans = atof(v);
+        else if(a == "--objects") sh.objects = atof(v);
+        else if(a == "--escapes") sh.escapes = atof(v);
+        else if(a == "--whitespace") sh.whitespace = v;
+        else if(a == "--bytes") sh.bytes = strtoull(v, nullptr, 10);
+        else {
+            std::cerr << "unknown option " << a << std::endl;
+            return 2;
+        }
+    }
+    if(sh.fanout_max < sh.fanout_min || sh.string_max < sh.string_min) {
+        std::cerr << "max below min" << std::endl;
+        return 2;
+    }
+    std::cout << workload::generate(sh);
+    return 0;
+}
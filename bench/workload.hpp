@@ -0,0 +1,146 @@
+// deterministic synthetic documents of a controlled shape
+// the same shape and seed always produce the same bytes, see bench/workload.cpp for the command line tool
+
+#ifndef JSON_BENCH_WORKLOAD_HPP
+#define JSON_BENCH_WORKLOAD_HPP
+
+#include "corpus.hpp"
+#include <cmath>
+
+namespace workload {
+    struct shape {
+        uint64_t seed = 1;
+        int depth = 4;              // nesting levels below the root
+        int fanout_min = 2;         // children per array or object
+        int fanout_max = 8;
+        int keys = 64;              // distinct object keys, reused across objects
+        int string_min = 0;         // string length in bytes
+        int string_max = 32;
+        bool string_geometric = false; // lengths cluster near string_min with a long tail up to string_max
+        double numbers = 0.3;       // share of leaves that are numbers
+        double booleans = 0.1;      // share of leaves that are booleans, the rest are strings
+        double objects = 0.5;       // share of containers that are objects, the rest are arrays
+        double escapes = 0.02;      // chance of each string character being an escape sequence
+        std::string whitespace = "pretty"; // compact, spaced or pretty
+        size_t bytes = 64 * 1024;   // the root array grows until this size is reached
+    };
+
+    class generator {
+        const shape& sh;
+        corpus::rng r;
+        std::string out;
+        int length() {
+            if(!sh.string_geometric) return r.range(sh.string_min, sh.string_max);
+            double mean = 1 + (sh.string_max - sh.string_min) / 8.0;
+            int n = sh.string_min + (int)(-std::log(1 - r.unit()) * mean);
+            return n > sh.string_max? sh.string_max : n;
+        }
+        void newline(int level) {
+            if(sh.whitespace == "pretty") {
+                out += '\n';
+                out.append(level * 4, ' ');
+            }
+            else if(sh.whitespace == "spaced") {
+                out += ' ';
+            }
+        }
+        void key(int i) {
+            out += "\"k";
+            out += std::to_string(i);
+            out += '"';
+            out += sh.whitespace == "compact"? ":" : ": ";
+        }
+        void string() {
+            static const char* escapes[] = { "\\\"", "\\\\", "\\n", "\\t", "\\/", "\\u00e9" };
+            out += '"';
+            int n = length();
+            for(int i = 0; i < n; i++) {
+                if(r.unit() < sh.escapes) out += escapes[r.range(0, 5)];
+                else out += (char)('a' + r.range(0, 25));
+            }
+            out += '"';
+        }
+        void leaf() {
+            double p = r.unit();
+            if(p < sh.numbers) {
+                out += std::to_string(r.range(0, 1000000));
+                if(r.range(0, 1)) out += "." + std::to_string(r.range(0, 999999));
+            }
+            else if(p < sh.numbers + sh.booleans) {
+                out += r.range(0, 1)? "true" : "false";
+            }
+            else {
+                string();
+            }
+        }
+        void element(int level) {
+            if(level > sh.depth) {
+                leaf();
+                return;
+            }
+            bool object = r.unit() < sh.objects;
+            int n = r.range(sh.fanout_min, sh.fanout_max);
+            int first = n > 0 && sh.keys > 0? r.range(0, sh.keys - 1) : 0;
+            out += object? '{' : '[';
+            for(int i = 0; i < n; i++) {
+                if(i) out += ',';
+                newline(level + 1);
+                if(object) key((first + i) % (sh.keys > 0? sh.keys : 1));
+                element(level + 1);
+            }
+            if(n) newline(level);
+            out += object? '}' : ']';
+        }
+        public:
+            generator(const shape& sh) : sh(sh), r(sh.seed) {}
+            std::string run() {
+                out = "[";
+                for(int i = 0; out.size() < sh.bytes; i++) {
+                    if(i) out += ',';
+                    newline(1);
+                    element(1);
+                }
+                newline(0);
+                out += "]\n";
+                return out;
+            }
+    };
+    std::string generate(const shape& sh) {
+        return generator(sh).run();
+    }
+
+    // shapes the fixed corpora miss, sized to bytes
+    std::vector<std::pair<std::string, shape>> presets(size_t bytes) {
+        std::vector<std::pair<std::string, shape>> p;
+        shape mixed;
+        p.push_back({ "mixed", mixed });
+        shape wide;
+        wide.depth = 1;
+        wide.fanout_min = wide.fanout_max = 4096;
+        wide.keys = 4096;
+        wide.objects = 1;
+        p.push_back({ "wide", wide });
+        shape deep;
+        deep.depth = 256;
+        deep.fanout_min = deep.fanout_max = 1;
+        deep.whitespace = "compact";
+        p.push_back({ "deep", deep });
+        shape strings;
+        strings.numbers = strings.booleans = 0;
+        strings.string_max = 4096;
+        strings.string_geometric = true;
+        strings.escapes = 0.1;
+        p.push_back({ "strings", strings });
+        shape numbers;
+        numbers.numbers = 1;
+        numbers.objects = 0;
+        numbers.fanout_min = numbers.fanout_max = 64;
+        numbers.depth = 2;
+        numbers.whitespace = "compact";
+        p.push_back({ "numbers", numbers });
+        for(auto& e : p) e.second.bytes = bytes;
+        return p;
+    }
+};
+
+#endif
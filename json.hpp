@@ -16,48 +16,757 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <new>
+#include <array>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+
+#ifndef JSON_INLINE_CHILDREN
+#define JSON_INLINE_CHILDREN 4 // array children stored in the node of the array before spilling to the heap
+#endif
+#ifndef JSON_INLINE_MEMBERS
+#define JSON_INLINE_MEMBERS 4 // object entries stored in the node of the object before spilling to the heap
+#endif
+#ifndef JSON_HASH_INDEX
+#define JSON_HASH_INDEX 16 // a hash with this many entries gets a key index, smaller ones are scanned
+#endif
+#if !defined(JSON_NO_POOL) && !defined(JSON_ALLOC_STATS)
+#define JSON_POOL // value nodes come from per-thread slabs, see json_internals::pool, the stats count plain allocations
+#include <atomic>
+#include <mutex>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#endif
 
 // -----------------------------------
 //             PUBLIC API             
 // -----------------------------------
 
 namespace json {
+    template <typename T, size_t N>
+    class small_vector { // an std::vector-like container whose first N elements can live in storage next to its owner
+        public:
+            typedef T value_type;
+            typedef T* iterator;
+            typedef const T* const_iterator;
+            typedef size_t size_type;
+            struct storage {
+                alignas(T) unsigned char bytes[N? N * sizeof(T) : 1];
+            };
+        private:
+            T* p = nullptr;
+            T* local = nullptr; // the storage given to attach
+            uint32_t n = 0;
+            uint32_t cap = 0;
+            void grow(size_t c);
+        public:
+            small_vector();
+            small_vector(std::initializer_list<T> il);
+            small_vector(const small_vector& o);
+            small_vector(small_vector&& o);
+            ~small_vector();
+            small_vector& operator = (const small_vector& o);
+            small_vector& operator = (small_vector&& o);
+            template <typename It> void assign(It first, It last);
+            T* begin();
+            T* end();
+            const T* begin() const;
+            const T* end() const;
+            T* data();
+            size_t size() const;
+            size_t capacity() const;
+            bool empty() const;
+            bool spilled() const; // true when the elements live on the heap
+            void attach(storage& s); // the first N elements live in s from now on, s must outlive the vector
+            size_t inline_capacity() const; // N once attached, 0 otherwise
+            T& operator [] (size_t i);
+            const T& operator [] (size_t i) const;
+            T& at(size_t i); // throws std::out_of_range past size()
+            const T& at(size_t i) const;
+            T& front();
+            T& back();
+            const T& front() const;
+            const T& back() const;
+            void reserve(size_t c);
+            void shrink_to_fit();
+            void resize(size_t c); // new elements are value-initialized
+            void resize(size_t c, const T& e);
+            void push_back(const T& e);
+            void push_back(T&& e);
+            template <typename... A> T& emplace_back(A&&... a);
+            void pop_back();
+            T* insert(T* pos, const T& e);
+            T* insert(T* pos, T&& e);
+            template <typename It> T* insert(T* pos, It first, It last);
+            T* erase(T* first, T* last);
+            T* erase(T* pos);
+            void clear();
+    };
     template <typename T>
     class hash { // an std::map-like container with insertion order
-        std::vector<std::pair<std::string, T>> v;
+        small_vector<std::pair<std::string, T>, JSON_INLINE_MEMBERS> v;
+        struct extra { // allocated once an object has tombstones or a key index, most never do
+            std::vector<bool> dead; // tombstones left by erase, empty when there are none
+            size_t holes = 0;
+            std::vector<uint32_t> index; // open addressing, entry position + 1, 0 empty, ~0 erased
+            size_t indexed = 0; // slots in use including erased ones
+            size_t covered = 0; // entries the index has seen, those appended through vector() after them are scanned
+        };
+        std::unique_ptr<extra> x;
+        extra& more();
+        size_t holes() const;
+        bool indexed() const;
+        bool dead(size_t i) const;
+        void compact();
+        void reindex();
+        void insert(size_t pos);
+        static size_t digest(const char* key, size_t n); // siphash-1-3 under a key drawn once per process
+        size_t slot(const char* key, size_t n) const; // index slot holding key, or the empty slot that ends its probe
+        size_t slot(const std::string& key) const;
+        size_t find(const std::string& key) const; // entry position or v.size()
         public:
             hash();
             hash(std::initializer_list<std::pair<std::string, T>> il);
-            std::vector<std::pair<std::string, T>>& vector();
+            hash(const hash& o);
+            hash(hash&& o);
+            hash& operator = (const hash& o);
+            hash& operator = (hash&& o);
+            // compacts pending erases and drops the key index, so any write through it is safe, lookups scan the entries
+            // until rehash() or the next insert; read with each(), which keeps the index
+            small_vector<std::pair<std::string, T>, JSON_INLINE_MEMBERS>& vector();
+            void rehash(); // gives an object of JSON_HASH_INDEX keys or more its key index, as inserting does
+            size_t size() const;
             bool has(const std::string& key) const;
             T& operator [] (const std::string& key);
+            bool erase(const std::string& key); // keeps the order of the remaining keys
+            void reserve(size_t n);
+            void extend(const hash& o); // assigns every key of o, new keys go last
+            template <typename F> size_t retain_if(F f); // keeps the entries where f(key, value) is true
+            // nullptr for missing keys, never inserts or allocates, a probe per key with a key index,
+            // otherwise one pass over the entries for every 64 keys
+            size_t extract(std::initializer_list<const char*> keys, T** out);
+            template <typename F> void each(F f) const; // f(key, value) for every entry in order, safe for concurrent readers
+            template <typename F> void each(F f);       // the same with the values writable, the object itself is not changed
+            size_t heap_bytes(size_t* slack = nullptr, size_t* keys = nullptr, size_t* index = nullptr) const; // not counting what values own
+            void attach(typename small_vector<std::pair<std::string, T>, JSON_INLINE_MEMBERS>::storage& s); // see small_vector::attach
+            size_t inline_capacity() const;
+    };
+    template <size_t N>
+    class keyset { // a perfect hash over N keys known at compile time, see json::keys()
+        static constexpr size_t slots(size_t c = 1) { return c >= 4 * N? c : slots(c * 2); }
+        static constexpr uint32_t mix(const char* s, size_t n, uint32_t seed);
+        static constexpr size_t length(const char* s);
+        const char* k[N];
+        size_t len[N];
+        uint32_t seed;
+        int table[slots()]; // slot -> key index, -1 when empty
+        public:
+            template <typename... K> constexpr keyset(const K&... keys);
+            constexpr int find(const char* s, size_t n) const; // key index or -1
+            template <typename T> std::array<T*, N> extract(hash<T>& h) const; // one pass, nullptr for missing keys
     };
+    template <typename... K> constexpr keyset<sizeof...(K)> keys(const K&... keys); // static constexpr auto ks = json::keys("id", "ts");
     struct value {
         std::string type;
         bool boolean;
         double number;
         std::string string;
-        std::vector<std::shared_ptr<value>> array;
-        hash<std::shared_ptr<value>> object;
+        small_vector<std::shared_ptr<value>, JSON_INLINE_CHILDREN> array; // the inline slots of both are in the node
+        hash<std::shared_ptr<value>> object;                               // of arrays and objects, see json::array()
     };
     std::shared_ptr<value> boolean(bool boolean);
     std::shared_ptr<value> number(double number);
     std::shared_ptr<value> string(const std::string& string);
     std::shared_ptr<value> array(const std::vector<std::shared_ptr<value>>& array);
     std::shared_ptr<value> object(const hash<std::shared_ptr<value>>& object);
+    struct decode_stats { // filled by every decode, costs a few counters and two tick reads
+        size_t bytes = 0;         // consumed by the root element, or scanned up to the error
+        size_t nodes = 0;
+        size_t booleans = 0;
+        size_t numbers = 0;
+        size_t strings = 0;
+        size_t arrays = 0;
+        size_t objects = 0;
+        int depth = 0;            // deepest nesting, the root is 1
+        uint64_t scan_ticks = 0;  // parsing the input, see json_internals::ticks()
+        uint64_t build_ticks = 0; // building the values
+        uint64_t allocated = 0;   // bytes, needs -DJSON_ALLOC_STATS
+    };
+    struct decode_options { // limits for untrusted input, checked while parsing, 0 is no limit
+        size_t max_bytes = 0;
+        int max_depth = 0;        // the root is 1
+        size_t max_nodes = 0;
+        size_t max_string = 0;    // bytes between the quotes, escapes as written
+        size_t max_allocated = 0; // parse tree and values, estimated per node, exact with -DJSON_ALLOC_STATS
+    };
     struct decoded {
         int error;
-        std::shared_ptr<value> value;
+        std::shared_ptr<json::value> value;
+        decode_stats stats;
+        std::string limit; // the decode_options limit that stopped the decode at error, empty otherwise
     };
     decoded decode(const std::string& s);
+    decoded decode(const std::string& s, const decode_options& o);
     std::string encode(const std::shared_ptr<value>& v);
+    std::string encode_line(const std::shared_ptr<value>& v); // compact on one line, numbers in full without exponents,
+                                                              // raw line breaks in strings become \n and \r
+    struct alloc_stats { // filled while an alloc_scope is alive, needs -DJSON_ALLOC_STATS
+        struct counter {
+            uint64_t allocs = 0;
+            uint64_t frees = 0;
+            uint64_t bytes = 0; // allocated, frees do not subtract
+            uint64_t live = 0;
+            uint64_t peak = 0;  // highest live
+        };
+        counter other;  // anything outside decode, encode and the value factories
+        counter ast;    // the parse tree of decode
+        counter value;  // value nodes with their shared_ptr control blocks
+        counter string; // string contents and the output of encode
+        counter vector; // array storage beyond the inline slots
+        counter hash;   // object keys, entry storage and key indexes
+        counter total;
+    };
+    class alloc_scope { // counts every allocation of this thread into stats until destroyed
+        alloc_stats* saved;
+        public:
+            alloc_scope(alloc_stats& stats);
+            ~alloc_scope();
+    };
+    std::shared_ptr<value> metrics(); // snapshot of the metrics registry as json, needs -DJSON_METRICS
+    void metrics_reset();
+    struct capture_options { // sampling of decode inputs into a corpus file, needs -DJSON_CAPTURE
+        std::string path;
+        double fraction = 0.01;            // share of decode calls that are written
+        size_t max_bytes = 64 << 20;       // the file stops growing at this size
+        size_t max_record = 1 << 20;       // larger inputs are skipped
+        bool scrub = true;                 // see json::scrub
+    };
+    bool capture(const capture_options& o); // false when the file cannot be opened
+    void capture_stop();
+    std::string scrub(const std::string& s); // keeps keys and structure, blanks string contents and digits
+    struct memory { // heap bytes requested by a value tree, allocator rounding and headers not included
+        size_t total = 0;
+        size_t nodes = 0;    // value structs, inline children included
+        size_t control = 0;  // shared_ptr control blocks
+        size_t strings = 0;  // string contents and keys that do not fit the small string buffer
+        size_t children = 0; // array slots and object entries spilled to the heap and in use
+        size_t slack = 0;    // spilled capacity not in use, tombstones included
+        size_t index = 0;    // object key indexes and tombstone bitmaps
+        std::vector<std::pair<std::string, size_t>> top; // heaviest subtrees below the root by json pointer, heaviest first
+    };
+    memory memory_usage(const std::shared_ptr<value>& v, size_t top = 0); // nodes shared within the tree count once
+    struct path_profile { // where a decode spends its time, by json pointer with array indices collapsed to *
+        struct entry { // self costs, what the children of the path take is in their own entries
+            size_t nodes = 0;
+            size_t bytes = 0;        // input bytes, the keys, whitespace and brackets of a container included
+            uint64_t scan_ticks = 0;
+            uint64_t build_ticks = 0;
+            uint64_t allocs = 0;     // needs -DJSON_ALLOC_STATS
+            uint64_t allocated = 0;  // bytes, needs -DJSON_ALLOC_STATS
+        };
+        std::vector<std::pair<std::string, entry>> paths; // in order of first appearance, the root is ""
+        std::string folded(const std::string& weight = "ticks") const; // flamegraph.pl input, weight is ticks, scan_ticks,
+                                                                        // build_ticks, nodes, bytes, allocs or allocated
+    };
+    decoded decode_profiled(const std::string& s, path_profile& p); // decode that also fills p, many times slower
+    // rebuilds a tree a few nodes at a time, the tree must not change until step() returns true
+    // dedup makes equal strings a single node shared by every place they occur, so writing to the string of one
+    // of them changes them all, replace such a node (obj["a"] = json::string("b")) rather than assigning to its string
+    class compactor {
+        struct state;
+        std::shared_ptr<value>& root;
+        std::unique_ptr<state> s;
+        public:
+            compactor(std::shared_ptr<value>& root, bool dedup = false);
+            ~compactor();
+            bool step(size_t budget); // copies about budget nodes, an object in one go, true once root points to the new tree
+    };
+    void compact(std::shared_ptr<value>& v, bool dedup = false); // see compactor, in one go
 };
 
 // --------------------------------------------------------
 // ---------------- PRIVATE IMPLEMENTATION ----------------
 // --------------------------------------------------------
 
+namespace json_internals {
+    namespace alloc { // categories of json::alloc_stats, set around the code that allocates
+        enum category { other, ast, value, string, vector, hash };
+    #ifdef JSON_ALLOC_STATS
+        thread_local json::alloc_stats* sink = nullptr;
+        thread_local int current = other;
+        thread_local uint64_t allocated = 0; // bytes on this thread, with or without a sink
+        thread_local uint64_t allocations = 0;
+        struct tag {
+            int saved;
+            tag(int c) : saved(current) { current = c; }
+            ~tag() { current = saved; }
+        };
+    #else
+        struct tag {
+            tag(int) {}
+        };
+    #endif
+    };
+    // the digest of object keys, keyed at random so that keys colliding in the index of an object cannot be chosen ahead
+    namespace siphash {
+        struct secret {
+            uint64_t k[2];
+            secret() {
+                try {
+                    std::random_device r;
+                    k[0] = (uint64_t)r() << 32 ^ r();
+                    k[1] = (uint64_t)r() << 32 ^ r();
+                }
+                catch(...) { // no entropy source, the load address still differs between runs
+                    k[0] = (uint64_t)reinterpret_cast<uintptr_t>(this) * 0x9e3779b97f4a7c15ull;
+                    k[1] = (uint64_t)reinterpret_cast<uintptr_t>(&k) * 0xc2b2ae3d27d4eb4full;
+                }
+            }
+        };
+        const secret& key() {
+            static secret s;
+            return s;
+        }
+        uint64_t rotl(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+        void round(uint64_t* v) {
+            v[0] += v[1]; v[1] = rotl(v[1], 13); v[1] ^= v[0]; v[0] = rotl(v[0], 32);
+            v[2] += v[3]; v[3] = rotl(v[3], 16); v[3] ^= v[2];
+            v[0] += v[3]; v[3] = rotl(v[3], 21); v[3] ^= v[0];
+            v[2] += v[1]; v[1] = rotl(v[1], 17); v[1] ^= v[2]; v[2] = rotl(v[2], 32);
+        }
+        uint64_t digest(const char* p, size_t n) { // one round per 8 bytes, three to finish
+            const uint64_t* k = key().k;
+            uint64_t v[4] = { k[0] ^ 0x736f6d6570736575ull, k[1] ^ 0x646f72616e646f6dull, k[0] ^ 0x6c7967656e657261ull, k[1] ^ 0x7465646279746573ull };
+            size_t whole = n - n % 8;
+            for(size_t i = 0; i < whole; i += 8) {
+                uint64_t m;
+                std::memcpy(&m, p + i, 8);
+                v[3] ^= m;
+                round(v);
+                v[0] ^= m;
+            }
+            uint64_t m = (uint64_t)n << 56;
+            for(size_t i = whole; i < n; i++) m |= (uint64_t)(unsigned char)p[i] << (8 * (i - whole));
+            v[3] ^= m;
+            round(v);
+            v[0] ^= m;
+            v[2] ^= 0xff;
+            round(v);
+            round(v);
+            round(v);
+            return v[0] ^ v[1] ^ v[2] ^ v[3];
+        }
+    };
+#ifdef JSON_POOL
+    // a value node and its shared_ptr control block are a single allocate_shared block carved from a 64K slab
+    // every thread owns its slabs and keeps a free list per 16 byte size class, allocating is a pop without locks
+    // blocks freed by another thread are batched and pushed to the atomic stack of their owner with one exchange,
+    // the owner takes the whole stack when a free list runs dry, and is found from the slab header at the 64K boundary
+    // slabs are reused but never returned to the system, the owner of a finished thread is adopted by the next one
+    namespace pool {
+        const size_t slab_bytes = 64 * 1024;
+        const size_t granule = 16;
+        const size_t classes = 64; // blocks up to 1K, larger ones go to operator new
+        const size_t batch = 32;   // remote frees pushed at once
+        struct block {
+            block* next;
+        };
+        struct owner {
+            block* free[classes] = {};
+            char* next[classes] = {};  // uncarved part of the newest slab of each class
+            char* limit[classes] = {};
+            std::atomic<block*> remote{ nullptr };
+            owner* abandoned = nullptr;
+        };
+        struct alignas(64) slab {
+            owner* o;
+            size_t size; // of its blocks
+        };
+        struct registry {
+            std::mutex m;
+            owner* abandoned = nullptr;
+        };
+        registry& global() {
+            static registry* r = new registry(); // never destroyed, blocks may be freed during exit
+            return *r;
+        }
+        owner* adopt() {
+            registry& g = global();
+            std::lock_guard<std::mutex> l(g.m);
+            owner* o = g.abandoned;
+            if(!o) return new owner();
+            g.abandoned = o->abandoned;
+            return o;
+        }
+        void abandon(owner* o) {
+            registry& g = global();
+            std::lock_guard<std::mutex> l(g.m);
+            o->abandoned = g.abandoned;
+            g.abandoned = o;
+        }
+        slab* of(void* p) {
+            return reinterpret_cast<slab*>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(slab_bytes - 1));
+        }
+        void push(owner* o, block* head, block* tail) { // a chain onto the remote stack of o
+            block* top = o->remote.load(std::memory_order_relaxed);
+            do {
+                tail->next = top;
+            } while(!o->remote.compare_exchange_weak(top, head, std::memory_order_release, std::memory_order_relaxed));
+        }
+        bool& gone() { // set when the thread's pool state is destroyed, frees during exit go straight to the owner
+            thread_local bool g = false;
+            return g;
+        }
+        struct local {
+            owner* o = nullptr;
+            int fresh = 0; // while positive blocks are carved from the slabs, see json::compact
+            owner* to = nullptr; // owner of the pending frees
+            block* head = nullptr;
+            block* tail = nullptr;
+            size_t n = 0;
+            void flush() {
+                if(head) push(to, head, tail);
+                head = tail = nullptr;
+                n = 0;
+            }
+            ~local() {
+                flush();
+                if(o) abandon(o);
+                gone() = true;
+            }
+        };
+        local& here() {
+            thread_local local l;
+            return l;
+        }
+        struct fresh {
+            fresh() { here().fresh++; }
+            ~fresh() { here().fresh--; }
+        };
+        void* carve(owner* o, size_t c, bool fresh = false) {
+            if(!fresh && !o->free[c]) {
+                block* b = o->remote.exchange(nullptr, std::memory_order_acquire);
+                while(b) {
+                    block* n = b->next;
+                    size_t k = of(b)->size / granule - 1;
+                    b->next = o->free[k];
+                    o->free[k] = b;
+                    b = n;
+                }
+            }
+            if(block* b = fresh? nullptr : o->free[c]) {
+                o->free[c] = b->next;
+                return b;
+            }
+            size_t size = (c + 1) * granule;
+            if(!o->next[c] || o->limit[c] - o->next[c] < (ptrdiff_t)size) {
+                void* m = nullptr;
+            #ifdef _WIN32
+                m = _aligned_malloc(slab_bytes, slab_bytes);
+            #else
+                if(posix_memalign(&m, slab_bytes, slab_bytes) != 0) m = nullptr;
+            #endif
+                if(!m) throw std::bad_alloc();
+                new (m) slab{ o, size };
+                o->next[c] = static_cast<char*>(m) + sizeof(slab);
+                o->limit[c] = static_cast<char*>(m) + slab_bytes;
+            }
+            void* r = o->next[c];
+            o->next[c] += size;
+            return r;
+        }
+        void* allocate(size_t n) {
+            if(n > classes * granule) return ::operator new(n);
+            size_t c = (n + granule - 1) / granule - 1;
+            if(gone()) {
+                owner* o = adopt();
+                void* p = carve(o, c);
+                abandon(o);
+                return p;
+            }
+            local& l = here();
+            if(!l.o) l.o = adopt();
+            return carve(l.o, c, l.fresh > 0);
+        }
+        void release(void* p, size_t n) {
+            if(n > classes * granule) {
+                ::operator delete(p);
+                return;
+            }
+            block* b = static_cast<block*>(p);
+            owner* o = of(p)->o;
+            if(gone()) {
+                push(o, b, b);
+                return;
+            }
+            local& l = here();
+            if(o == l.o) {
+                size_t c = of(p)->size / granule - 1;
+                b->next = o->free[c];
+                o->free[c] = b;
+                return;
+            }
+            if(o != l.to) {
+                l.flush();
+                l.to = o;
+            }
+            b->next = l.head;
+            l.head = b;
+            if(!l.tail) l.tail = b;
+            if(++l.n == batch) l.flush();
+        }
+        template <typename T>
+        struct allocator { // single objects from the pool, arrays from operator new
+            static_assert(alignof(T) <= granule, "json::pool: over aligned type");
+            typedef T value_type;
+            allocator() {}
+            template <typename U> allocator(const allocator<U>&) {}
+            T* allocate(size_t n) {
+                return static_cast<T*>(n == 1? pool::allocate(sizeof(T)) : ::operator new(n * sizeof(T)));
+            }
+            void deallocate(T* p, size_t n) {
+                if(n == 1) pool::release(p, sizeof(T));
+                else ::operator delete(p);
+            }
+            template <typename U> bool operator == (const allocator<U>&) const { return true; }
+            template <typename U> bool operator != (const allocator<U>&) const { return false; }
+        };
+    };
+#endif
+    // arrays and objects are allocated with room for their first children after the value, scalars without
+    struct array_node : json::value {
+        json::small_vector<std::shared_ptr<json::value>, JSON_INLINE_CHILDREN>::storage slots;
+        array_node() : json::value() { array.attach(slots); } // value() zeroes boolean and number as new value() does
+    };
+    struct object_node : json::value {
+        json::small_vector<std::pair<std::string, std::shared_ptr<json::value>>, JSON_INLINE_MEMBERS>::storage slots;
+        object_node() : json::value() { object.attach(slots); }
+    };
+#ifdef JSON_POOL
+    const size_t control_block = sizeof(void*) + 2 * sizeof(int); // vtable and the two counts, the value follows in the same block
+    template <typename N = json::value>
+    std::shared_ptr<json::value> node() {
+        return std::allocate_shared<N>(pool::allocator<N>());
+    }
+#else
+    const size_t control_block = 2 * sizeof(void*) + 2 * sizeof(int); // vtable, pointer and the two counts of shared_ptr(new value())
+    template <typename N = json::value>
+    std::shared_ptr<json::value> node() {
+        alloc::tag t(alloc::value);
+        return std::shared_ptr<json::value>(new N());
+    }
+#endif
+};
+
 namespace json {
+    template <typename T, size_t N>
+    small_vector<T, N>::small_vector() {}
+    template <typename T, size_t N>
+    small_vector<T, N>::small_vector(std::initializer_list<T> il) {
+        reserve(il.size());
+        assign(il.begin(), il.end());
+    }
+    template <typename T, size_t N>
+    small_vector<T, N>::small_vector(const small_vector& o) {
+        reserve(o.size());
+        assign(o.begin(), o.end());
+    }
+    template <typename T, size_t N>
+    small_vector<T, N>::small_vector(small_vector&& o) {
+        *this = std::move(o);
+    }
+    template <typename T, size_t N>
+    small_vector<T, N>::~small_vector() {
+        clear();
+        if(spilled()) ::operator delete(p);
+    }
+    template <typename T, size_t N>
+    small_vector<T, N>& small_vector<T, N>::operator = (const small_vector& o) {
+        if(this == &o) return *this;
+        clear();
+        reserve(o.size());
+        assign(o.begin(), o.end());
+        return *this;
+    }
+    template <typename T, size_t N>
+    small_vector<T, N>& small_vector<T, N>::operator = (small_vector&& o) {
+        if(this == &o) return *this;
+        clear();
+        if(o.spilled()) { // steal the heap block, the storage of attach stays with its owner
+            if(spilled()) ::operator delete(p);
+            p = o.p;
+            n = o.n;
+            cap = o.cap;
+            o.p = o.local;
+            o.n = 0;
+            o.cap = o.local? N : 0;
+            return *this;
+        }
+        reserve(o.size());
+        for(auto& e : o) push_back(std::move(e));
+        o.clear();
+        return *this;
+    }
+    template <typename T, size_t N>
+    template <typename It>
+    void small_vector<T, N>::assign(It first, It last) {
+        clear();
+        for(; first != last; ++first) push_back(*first);
+    }
+    template <typename T, size_t N>
+    void small_vector<T, N>::grow(size_t c) { // moves the elements to a block of exactly c slots, or to the attached storage
+        if(c > UINT32_MAX) throw std::length_error("json::small_vector: too many elements");
+        T* q = local && c <= N? local : c == 0? nullptr : static_cast<T*>(::operator new(c * sizeof(T)));
+        if(q == p) return;
+        for(size_t i = 0; i < n; i++) {
+            new (q + i) T(std::move(p[i]));
+            p[i].~T();
+        }
+        if(spilled()) ::operator delete(p);
+        p = q;
+        cap = q? (q == local? N : c) : 0; // an unattached vector shrunk to nothing has no storage at all
+    }
+    template <typename T, size_t N>
+    T* small_vector<T, N>::begin() { return p; }
+    template <typename T, size_t N>
+    T* small_vector<T, N>::end() { return p + n; }
+    template <typename T, size_t N>
+    const T* small_vector<T, N>::begin() const { return p; }
+    template <typename T, size_t N>
+    const T* small_vector<T, N>::end() const { return p + n; }
+    template <typename T, size_t N>
+    T* small_vector<T, N>::data() { return p; }
+    template <typename T, size_t N>
+    size_t small_vector<T, N>::size() const { return n; }
+    template <typename T, size_t N>
+    size_t small_vector<T, N>::capacity() const { return cap; }
+    template <typename T, size_t N>
+    bool small_vector<T, N>::empty() const { return n == 0; }
+    template <typename T, size_t N>
+    bool small_vector<T, N>::spilled() const { return p && p != local; }
+    template <typename T, size_t N>
+    void small_vector<T, N>::attach(storage& s) {
+        local = reinterpret_cast<T*>(s.bytes);
+        if(!p) { // otherwise the elements move in when shrink_to_fit finds they fit
+            p = local;
+            cap = N;
+        }
+    }
+    template <typename T, size_t N>
+    size_t small_vector<T, N>::inline_capacity() const { return local? N : 0; }
+    template <typename T, size_t N>
+    T& small_vector<T, N>::operator [] (size_t i) { return p[i]; }
+    template <typename T, size_t N>
+    const T& small_vector<T, N>::operator [] (size_t i) const { return p[i]; }
+    template <typename T, size_t N>
+    T& small_vector<T, N>::at(size_t i) {
+        if(i >= n) throw std::out_of_range("json::small_vector: index out of range");
+        return p[i];
+    }
+    template <typename T, size_t N>
+    const T& small_vector<T, N>::at(size_t i) const {
+        if(i >= n) throw std::out_of_range("json::small_vector: index out of range");
+        return p[i];
+    }
+    template <typename T, size_t N>
+    T& small_vector<T, N>::front() { return p[0]; }
+    template <typename T, size_t N>
+    T& small_vector<T, N>::back() { return p[n - 1]; }
+    template <typename T, size_t N>
+    const T& small_vector<T, N>::front() const { return p[0]; }
+    template <typename T, size_t N>
+    const T& small_vector<T, N>::back() const { return p[n - 1]; }
+    template <typename T, size_t N>
+    void small_vector<T, N>::reserve(size_t c) {
+        if(c > cap) grow(c);
+    }
+    template <typename T, size_t N>
+    void small_vector<T, N>::shrink_to_fit() {
+        if(spilled() && n < cap) grow(n);
+    }
+    template <typename T, size_t N>
+    void small_vector<T, N>::resize(size_t c) {
+        reserve(c);
+        while(n > c) pop_back();
+        while(n < c) emplace_back();
+    }
+    template <typename T, size_t N>
+    void small_vector<T, N>::resize(size_t c, const T& e) {
+        if(c > cap) {
+            T tmp(e); // the argument may alias an element
+            reserve(c);
+            while(n < c) emplace_back(tmp);
+            return;
+        }
+        while(n > c) pop_back();
+        while(n < c) emplace_back(e);
+    }
+    template <typename T, size_t N>
+    void small_vector<T, N>::push_back(const T& e) {
+        emplace_back(e);
+    }
+    template <typename T, size_t N>
+    void small_vector<T, N>::push_back(T&& e) {
+        emplace_back(std::move(e));
+    }
+    template <typename T, size_t N>
+    template <typename... A>
+    T& small_vector<T, N>::emplace_back(A&&... a) {
+        if(n == cap) {
+            T tmp(std::forward<A>(a)...); // the argument may alias an element
+            grow(cap? 2 * (size_t)cap : 4);
+            new (p + n) T(std::move(tmp));
+        }
+        else {
+            new (p + n) T(std::forward<A>(a)...);
+        }
+        return p[n++];
+    }
+    template <typename T, size_t N>
+    void small_vector<T, N>::pop_back() {
+        p[--n].~T();
+    }
+    template <typename T, size_t N>
+    T* small_vector<T, N>::insert(T* pos, const T& e) {
+        return insert(pos, T(e)); // the argument may alias an element
+    }
+    template <typename T, size_t N>
+    T* small_vector<T, N>::insert(T* pos, T&& e) {
+        size_t at = pos - p;
+        emplace_back(std::move(e));
+        std::rotate(p + at, p + n - 1, p + n);
+        return p + at;
+    }
+    template <typename T, size_t N>
+    template <typename It>
+    T* small_vector<T, N>::insert(T* pos, It first, It last) {
+        size_t at = pos - p, old = n;
+        for(; first != last; ++first) emplace_back(*first);
+        std::rotate(p + at, p + old, p + n);
+        return p + at;
+    }
+    template <typename T, size_t N>
+    T* small_vector<T, N>::erase(T* first, T* last) {
+        if(first == last) return first;
+        T* w = first;
+        for(T* r = last; r != end(); r++, w++) *w = std::move(*r);
+        while(end() != w) pop_back();
+        return first;
+    }
+    template <typename T, size_t N>
+    T* small_vector<T, N>::erase(T* pos) {
+        return erase(pos, pos + 1);
+    }
+    template <typename T, size_t N>
+    void small_vector<T, N>::clear() {
+        while(n > 0) pop_back();
+    }
+
     template <typename T>
     hash<T>::hash() {}
     template <typename T>
@@ -67,53 +776,369 @@ namespace json {
         }
     }
     template <typename T>
-    std::vector<std::pair<std::string, T>>& hash<T>::vector() { return v; }
+    hash<T>::hash(const hash& o) : v(o.v), x(o.x? new extra(*o.x) : nullptr) {}
     template <typename T>
-    bool hash<T>::has(const std::string& key) const {
-        for(auto& e : v) {
-            if(e.first == key) {
-                return true;
-            }
+    hash<T>::hash(hash&& o) : v(std::move(o.v)), x(std::move(o.x)) {}
+    template <typename T>
+    hash<T>& hash<T>::operator = (const hash& o) {
+        if(this == &o) return *this;
+        v = o.v;
+        x.reset(o.x? new extra(*o.x) : nullptr);
+        return *this;
+    }
+    template <typename T>
+    hash<T>& hash<T>::operator = (hash&& o) {
+        if(this == &o) return *this;
+        v = std::move(o.v);
+        x = std::move(o.x);
+        return *this;
+    }
+    template <typename T>
+    typename hash<T>::extra& hash<T>::more() {
+        if(!x) x.reset(new extra());
+        return *x;
+    }
+    template <typename T>
+    size_t hash<T>::holes() const { return x? x->holes : 0; }
+    template <typename T>
+    bool hash<T>::indexed() const { return x && !x->index.empty(); }
+    template <typename T>
+    bool hash<T>::dead(size_t i) const { return x && x->holes > 0 && x->dead[i]; }
+    template <typename T>
+    void hash<T>::compact() {
+        if(holes() == 0) return;
+        size_t w = 0;
+        for(size_t r = 0; r < v.size(); r++) {
+            if(x->dead[r]) continue;
+            if(w != r) v[w] = std::move(v[r]);
+            w++;
         }
-        return false;
+        v.erase(v.begin() + w, v.end());
+        x->dead.clear();
+        x->holes = 0;
+        if(indexed()) reindex();
     }
     template <typename T>
-    T& hash<T>::operator [] (const std::string& key) {
+    void hash<T>::reindex() {
+        extra& e = more();
+        size_t c = 4 * JSON_HASH_INDEX;
+        while(c < v.size() * 2) c *= 2;
+        e.index.assign(c, 0);
+        e.indexed = 0;
+        for(size_t i = 0; i < v.size(); i++) {
+            if(dead(i)) continue;
+            if(e.index[slot(v[i].first)] == 0) insert(i); // duplicated keys resolve to the first one
+        }
+        e.covered = v.size();
+    }
+    template <typename T>
+    void hash<T>::insert(size_t pos) {
+        if((x->indexed + 1) * 2 > x->index.size()) { // reindex covers pos, it is already in v
+            reindex();
+            return;
+        }
+        x->index[slot(v[pos].first)] = pos + 1;
+        x->indexed++;
+        x->covered = pos + 1;
+    }
+    template <typename T>
+    size_t hash<T>::digest(const char* key, size_t n) {
+        return static_cast<size_t>(json_internals::siphash::digest(key, n));
+    }
+    template <typename T>
+    size_t hash<T>::slot(const char* key, size_t n) const {
+        const std::vector<uint32_t>& index = x->index;
+        size_t mask = index.size() - 1;
+        for(size_t i = digest(key, n) & mask; ; i = (i + 1) & mask) {
+            uint32_t e = index[i];
+            if(e == 0) return i;
+            if(e == ~0u) continue;
+            const std::string& k = v[e - 1].first;
+            if(k.size() == n && std::memcmp(k.data(), key, n) == 0) return i;
+        }
+    }
+    template <typename T>
+    size_t hash<T>::slot(const std::string& key) const {
+        return slot(key.data(), key.size());
+    }
+    template <typename T>
+    size_t hash<T>::find(const std::string& key) const {
+        size_t from = 0;
+        if(indexed()) {
+            uint32_t e = x->index[slot(key)];
+            if(e != 0) return e - 1;
+            from = x->covered;
+        }
+        for(size_t i = from; i < v.size(); i++) {
+            if(v[i].first == key && !dead(i)) return i;
+        }
+        return v.size();
+    }
+    template <typename T>
+    small_vector<std::pair<std::string, T>, JSON_INLINE_MEMBERS>& hash<T>::vector() {
+        if(indexed()) { // the caller may reorder, erase or rename entries, none of which the index would see
+            std::vector<uint32_t>().swap(x->index);
+            x->indexed = 0;
+            x->covered = 0;
+        }
+        compact();
+        return v;
+    }
+    template <typename T>
+    void hash<T>::rehash() {
+        if(indexed() || size() >= JSON_HASH_INDEX) reindex();
+    }
+    template <typename T>
+    template <typename F>
+    void hash<T>::each(F f) const {
+        for(size_t i = 0; i < v.size(); i++) {
+            if(dead(i)) continue;
+            f(v[i].first, v[i].second);
+        }
+    }
+    template <typename T>
+    template <typename F>
+    void hash<T>::each(F f) {
+        for(size_t i = 0; i < v.size(); i++) {
+            if(dead(i)) continue;
+            f(static_cast<const std::string&>(v[i].first), v[i].second);
+        }
+    }
+    template <typename T>
+    size_t hash<T>::heap_bytes(size_t* slack, size_t* keys, size_t* index) const {
+        size_t sso = std::string().capacity();
+        size_t entries = v.spilled()? v.capacity() * sizeof(v[0]) : 0;
+        size_t k = 0;
         for(auto& e : v) {
-            if(e.first == key) {
-                return e.second;
-            }
+            if(e.first.capacity() > sso) k += e.first.capacity() + 1;
         }
+        size_t i = x? sizeof(extra) + x->index.capacity() * sizeof(uint32_t) + x->dead.capacity() / 8 : 0;
+        if(slack) *slack = v.spilled()? (v.capacity() - size()) * sizeof(v[0]) : 0; // tombstones count as slack
+        if(keys) *keys = k;
+        if(index) *index = i;
+        return entries + k + i;
+    }
+    template <typename T>
+    void hash<T>::attach(typename small_vector<std::pair<std::string, T>, JSON_INLINE_MEMBERS>::storage& s) {
+        v.attach(s);
+    }
+    template <typename T>
+    size_t hash<T>::inline_capacity() const { return v.inline_capacity(); }
+    template <typename T>
+    size_t hash<T>::size() const { return v.size() - holes(); }
+    template <typename T>
+    bool hash<T>::has(const std::string& key) const {
+        return find(key) != v.size();
+    }
+    template <typename T>
+    T& hash<T>::operator [] (const std::string& key) {
+        size_t i = find(key);
+        if(i != v.size()) return v[i].second; // a lookup never writes, readers may share the object
         v.push_back(std::pair<std::string, T>(key, T()));
+        if(holes() > 0) x->dead.push_back(false);
+        if(indexed() && x->covered == v.size() - 1) insert(v.size() - 1);
+        else if(indexed() || size() >= JSON_HASH_INDEX) reindex();
         return v[v.size() - 1].second;
     }
+    template <typename T>
+    bool hash<T>::erase(const std::string& key) {
+        size_t i = find(key);
+        if(i == v.size()) return false;
+        if(indexed()) {
+            size_t t = slot(key);
+            if(x->index[t] != 0) x->index[t] = ~0u;
+        }
+        if(i == v.size() - 1) { // nothing to keep in order behind it
+            v.pop_back();
+            if(holes() > 0) x->dead.pop_back();
+            if(x && x->covered > v.size()) x->covered = v.size();
+            return true;
+        }
+        extra& e = more();
+        if(e.holes == 0) e.dead.assign(v.size(), false);
+        e.dead[i] = true;
+        e.holes++;
+        v[i].first = std::string(); // release the entry now, the slot goes away on compaction
+        v[i].second = T();
+        if(e.holes * 2 > v.size()) compact();
+        return true;
+    }
+    template <typename T>
+    void hash<T>::reserve(size_t n) {
+        compact();
+        v.reserve(n);
+    }
+    template <typename T>
+    void hash<T>::extend(const hash& o) {
+        reserve(size() + o.size());
+        for(size_t i = 0; i < o.v.size(); i++) {
+            if(o.dead(i)) continue;
+            (*this)[o.v[i].first] = o.v[i].second;
+        }
+    }
+    template <typename T>
+    template <typename F>
+    size_t hash<T>::retain_if(F f) {
+        size_t w = 0;
+        size_t kept = 0;
+        for(size_t r = 0; r < v.size(); r++) {
+            if(dead(r)) continue;
+            if(!f(static_cast<const std::string&>(v[r].first), v[r].second)) continue;
+            if(w != r) v[w] = std::move(v[r]);
+            w++;
+            kept++;
+        }
+        size_t removed = v.size() - holes() - kept;
+        v.erase(v.begin() + w, v.end());
+        if(x) {
+            x->dead.clear();
+            x->holes = 0;
+        }
+        if(indexed()) reindex();
+        return removed;
+    }
+    template <typename T>
+    size_t hash<T>::extract(std::initializer_list<const char*> keys, T** out) {
+        size_t k = keys.size();
+        for(size_t j = 0; j < k; j++) out[j] = nullptr;
+        size_t found = 0;
+        if(indexed() && x->covered == v.size()) {
+            size_t j = 0;
+            for(const char* want : keys) {
+                uint32_t e = x->index[slot(want, std::strlen(want))];
+                if(e != 0 && e != ~0u) {
+                    out[j] = &v[e - 1].second;
+                    found++;
+                }
+                j++;
+            }
+            return found;
+        }
+        // the wanted keys go in a small open addressing table, every entry is hashed once and probes it
+        const size_t batch = 64;
+        const char* const* want = keys.begin();
+        for(size_t b = 0; b < k; b += batch) {
+            size_t m = std::min(batch, k - b), c = 2, left = m;
+            while(c < 2 * m) c *= 2;
+            size_t len[batch], h[batch];
+            uint8_t table[2 * batch];
+            std::memset(table, 0xff, c);
+            for(size_t j = 0; j < m; j++) {
+                len[j] = std::strlen(want[b + j]);
+                h[j] = digest(want[b + j], len[j]);
+                size_t t = h[j] & (c - 1);
+                while(table[t] != 0xff) t = (t + 1) & (c - 1);
+                table[t] = (uint8_t)j;
+            }
+            for(size_t i = 0; i < v.size() && left > 0; i++) {
+                if(dead(i)) continue;
+                const std::string& key = v[i].first;
+                size_t d = digest(key.data(), key.size());
+                for(size_t t = d & (c - 1); table[t] != 0xff; t = (t + 1) & (c - 1)) {
+                    size_t j = table[t];
+                    if(h[j] != d || len[j] != key.size() || out[b + j]) continue;
+                    if(std::memcmp(want[b + j], key.data(), len[j]) != 0) continue;
+                    out[b + j] = &v[i].second; // duplicated keys resolve to the first one, a key wanted twice is filled twice
+                    found++;
+                    left--;
+                }
+            }
+        }
+        return found;
+    }
+
+    template <size_t N>
+    constexpr uint32_t keyset<N>::mix(const char* s, size_t n, uint32_t seed) { // seeded fnv-1a
+        uint32_t h = 2166136261u ^ seed;
+        for(size_t i = 0; i < n; i++) {
+            h ^= static_cast<unsigned char>(s[i]);
+            h *= 16777619u;
+        }
+        h ^= h >> 15;
+        h *= 0x2c1b3c6du;
+        h ^= h >> 12;
+        return h;
+    }
+    template <size_t N>
+    constexpr size_t keyset<N>::length(const char* s) {
+        size_t n = 0;
+        while(s[n]) n++;
+        return n;
+    }
+    template <size_t N>
+    template <typename... K>
+    constexpr keyset<N>::keyset(const K&... keys) : k{ keys... }, len{ length(keys)... }, seed(0), table{} {
+        for(;; seed++) { // search a seed without collisions
+            if(seed > 1000000) throw "json::keyset: duplicate keys";
+            for(size_t i = 0; i < slots(); i++) table[i] = -1;
+            bool perfect = true;
+            for(size_t i = 0; i < N && perfect; i++) {
+                size_t slot = mix(k[i], len[i], seed) & (slots() - 1);
+                if(table[slot] != -1) perfect = false;
+                table[slot] = i;
+            }
+            if(perfect) return;
+        }
+    }
+    template <size_t N>
+    constexpr int keyset<N>::find(const char* s, size_t n) const {
+        int i = table[mix(s, n, seed) & (slots() - 1)];
+        if(i == -1 || len[i] != n) return -1;
+        for(size_t c = 0; c < n; c++) {
+            if(k[i][c] != s[c]) return -1;
+        }
+        return i;
+    }
+    template <size_t N>
+    template <typename T>
+    std::array<T*, N> keyset<N>::extract(hash<T>& h) const {
+        std::array<T*, N> r{};
+        size_t found = 0;
+        h.each([&](const std::string& key, T& value) { // reads the object only, handlers may share it
+            if(found == N) return;
+            int i = table[mix(key.data(), key.size(), seed) & (slots() - 1)];
+            if(i == -1 || r[i] || len[i] != key.size()) return;
+            if(std::memcmp(k[i], key.data(), len[i]) != 0) return;
+            r[i] = &value;
+            found++;
+        });
+        return r;
+    }
+    template <typename... K>
+    constexpr keyset<sizeof...(K)> keys(const K&... keys) {
+        return keyset<sizeof...(K)>(keys...);
+    }
 
     std::shared_ptr<value> boolean(bool boolean) {
-        std::shared_ptr<value> v = std::shared_ptr<value>(new value());
+        std::shared_ptr<value> v = json_internals::node();
         v->type = "boolean";
         v->boolean = boolean;
         return v;
     }
     std::shared_ptr<value> number(double number) {
-        std::shared_ptr<value> v = std::shared_ptr<value>(new value());
+        std::shared_ptr<value> v = json_internals::node();
         v->type = "number";
         v->number = number;
         return v;
     }
     std::shared_ptr<value> string(const std::string& string) {
-        std::shared_ptr<value> v = std::shared_ptr<value>(new value());
+        std::shared_ptr<value> v = json_internals::node();
+        json_internals::alloc::tag t(json_internals::alloc::string);
         v->type = "string";
         v->string = string;
         return v;
     }
     std::shared_ptr<value> array(const std::vector<std::shared_ptr<value>>& array) {
-        std::shared_ptr<value> v = std::shared_ptr<value>(new value());
+        std::shared_ptr<value> v = json_internals::node<json_internals::array_node>();
+        json_internals::alloc::tag t(json_internals::alloc::vector);
         v->type = "array";
-        v->array = array;
+        v->array.reserve(array.size());
+        v->array.assign(array.begin(), array.end());
         return v;
     }
     std::shared_ptr<value> object(const hash<std::shared_ptr<value>>& object) {
-        std::shared_ptr<value> v = std::shared_ptr<value>(new value());
+        std::shared_ptr<value> v = json_internals::node<json_internals::object_node>();
+        json_internals::alloc::tag t(json_internals::alloc::hash);
         v->type = "object";
         v->object = object;
         return v;
@@ -124,6 +1149,40 @@ namespace json {
 #include <functional>
 #include <regex>
 #include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <unordered_set>
+#include <unordered_map>
+#include <cmath>
+#include <cstdio>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef JSON_USDT // static tracepoints for bpftrace/systemtap, provider "json"
+#if defined(__has_include) && !__has_include(<sys/sdt.h>)
+#error "JSON_USDT needs <sys/sdt.h>, from systemtap-sdt-dev or systemtap-sdt-devel"
+#else
+#include <sys/sdt.h>
+#endif
+#define JSON_PROBE1(name, a)       STAP_PROBE1(json, name, a)
+#define JSON_PROBE2(name, a, b)    STAP_PROBE2(json, name, a, b)
+#else
+#define JSON_PROBE1(name, a)
+#define JSON_PROBE2(name, a, b)
+#endif
+#ifdef JSON_CAPTURE // decode input sampling, see json::capture
+#include <atomic>
+#include <mutex>
+#include <cstdio>
+#endif
+#ifdef JSON_METRICS // latency and size histograms, see json_internals::metrics
+#include <atomic>
+#include <mutex>
+#endif
+#ifdef JSON_PROFILE // per rule counters, see json_internals::profile
+#include <map>
+#include <iomanip>
+#endif
 
 namespace json_internals {
     typedef std::string str;
@@ -156,19 +1215,106 @@ namespace json_internals {
 
     typedef fun<ptr<ast>(const char* src, int pos)> rule;
 
+    uint64_t ticks() { // the time stamp counter, or nanoseconds where there is none
+    #if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+    #else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    #endif
+    }
+
+    // build with -DJSON_PROFILE to count every rule that has a tag, then call profile::report(std::cerr)
+    // the counters are shared and unsynchronized, profile one parsing thread at a time
+    namespace profile {
+        struct counters {
+            uint64_t calls = 0;
+            uint64_t successes = 0;
+            uint64_t failures = 0;
+            uint64_t backtracked = 0; // bytes examined by failed attempts
+            uint64_t self = 0;        // ticks excluding tagged rules called from this one
+            uint64_t total = 0;       // ticks including them
+        };
+    #ifdef JSON_PROFILE
+        std::map<str, counters>& table() {
+            static std::map<str, counters> t; // entries never move, rules keep pointers to them
+            return t;
+        }
+        uint64_t*& children() { // where the running rule collects the ticks of the tagged rules it calls
+            static uint64_t top = 0;
+            static uint64_t* current = &top;
+            return current;
+        }
+        struct nest { // points children() at inner for the scope, restored also when the rule throws limits::exceeded
+            uint64_t* outer;
+            nest(uint64_t* inner) : outer(children()) { children() = inner; }
+            ~nest() { children() = outer; }
+        };
+        void reset() {
+            for(auto& e : table()) e.second = counters();
+        }
+        void report(std::ostream& os) { // sorted by self time
+            vector<std::pair<str, counters>> rows(table().begin(), table().end());
+            std::sort(rows.begin(), rows.end(), [](auto& a, auto& b) { return a.second.self > b.second.self; });
+            uint64_t all = 0;
+            for(auto& e : rows) all += e.second.self;
+            os << std::left << std::setw(12) << "rule" << std::right << std::setw(12) << "calls" << std::setw(12) << "ok" << std::setw(12) << "failed"
+               << std::setw(14) << "backtracked" << std::setw(16) << "self ticks" << std::setw(8) << "self%" << std::setw(16) << "total ticks" << std::endl;
+            for(auto& e : rows) {
+                counters& c = e.second;
+                os << std::left << std::setw(12) << e.first << std::right << std::setw(12) << c.calls << std::setw(12) << c.successes << std::setw(12) << c.failures
+                   << std::setw(14) << c.backtracked << std::setw(16) << c.self << std::setw(7) << std::fixed << std::setprecision(1) << (all? 100.0 * c.self / all : 0) << "%"
+                   << std::setw(16) << c.total << std::endl;
+            }
+        }
+    #endif
+    };
+    bool isfail(ptr<ast> ast);
+    rule traced(const str& tag, const rule& r) { // counts the calls of r under its tag when profiling
+    #ifdef JSON_PROFILE
+        if(tag.empty()) return r;
+        profile::counters* c = &profile::table()[tag];
+        return [=](const char* s, int i) {
+            uint64_t inner = 0, spent;
+            uint64_t* outer;
+            ptr<ast> a;
+            {
+                profile::nest n(&inner);
+                outer = n.outer;
+                uint64_t t = ticks();
+                a = r(s, i);
+                spent = ticks() - t;
+            }
+            *outer += spent;
+            c->calls++;
+            c->total += spent;
+            c->self += spent - inner;
+            if(isfail(a)) {
+                c->failures++;
+                if(a->error > i) c->backtracked += a->error - i;
+            }
+            else {
+                c->successes++;
+            }
+            return a;
+        };
+    #else
+        (void)tag;
+        return r;
+    #endif
+    }
+
     rule token(const str& t, const str& tag = "") {
-        return [=](auto s, auto i) {
+        return traced(tag, [=](auto s, auto i) {
             s += i;
-            str cmp = str(s, 0, t.size());
-            if(t.compare(cmp) == 0) {
+            if(strncmp(s, t.c_str(), t.size()) == 0) { // str(s, 0, n) would copy the whole rest of the input
                 return ptr<ast>(new ast(i, t.size(), i, tag, {}, t));
             }
             return fail(i, i, tag);
-        };
+        });
     }
     rule regex(const str& re, const str& tag = "") { // too slow
         std::regex regexp(re);
-        return [=](auto s, auto i) {
+        return traced(tag, [=](auto s, auto i) {
             s += i;
             std::cmatch m;
             if(regex_search(s, m, regexp)) {
@@ -176,10 +1322,10 @@ namespace json_internals {
                 return ptr<ast>(new ast(i, r.size(), i, tag, {}, r));
             }
             return fail(i, i, tag);
-        };
+        });
     }
     rule all(const vector<rule>& rules, const str& tag = "") {
-        return [=](auto s, auto i) {
+        return traced(tag, [=](auto s, auto i) {
             int pos = i;
             int error = i;
             vector<ptr<ast>> data;
@@ -196,16 +1342,15 @@ namespace json_internals {
                 data.push_back(a);
             }
             return ptr<ast>(new ast(pos, i - pos, pos, tag, data, ""));
-        };
+        });
     }
     rule many(const rule& rule, const str& tag = "") {
-        return [=](auto s, auto i) {
-            int size = strlen(s);
+        return traced(tag, [=](auto s, auto i) {
             int pos = i;
             vector<ptr<ast>> data;
             for(;;) { // dead lock ***
                 ptr<ast> a = rule(s, i);
-                if(i + a->length >= size || isfail(a)) {
+                if(isfail(a) || s[i + a->length] == 0) { // end of input, without a strlen per call
                 // if(isfail(a)) {
                     return ptr<ast>(new ast(pos, i - pos, a->error, tag, data, "")); // fixed
                 }
@@ -213,10 +1358,10 @@ namespace json_internals {
                 data.push_back(a);
             }
             // never
-        };
+        });
     }
     rule cases(const vector<rule>& rules, const str& tag = "") {
-        return [=](auto s, auto i) {
+        return traced(tag, [=](auto s, auto i) {
             int error = i;
             for(auto& r : rules) {
                 ptr<ast> a = r(s, i);
@@ -228,13 +1373,74 @@ namespace json_internals {
                 }
             }
             return fail(i, error, tag);
-        };
+        });
     }
     rule lazy(const fun<rule()>& rule) { // forward definitions
         return [=](auto s, auto i) {
             return rule()(s, i);
         };
     }
+    rule lazy(const rule& (*rule)()) { // by reference, so the grammar is not copied per call
+        return [=](auto s, auto i) {
+            return rule()(s, i);
+        };
+    }
+
+    // decode_options are enforced by the rules below through the counters of the decoding thread,
+    // a rule that crosses a limit throws exceeded, which unwinds the parse before any value is built
+    namespace limits {
+        struct exceeded {
+            const char* limit;
+            int pos;
+        };
+        struct state {
+            const json::decode_options& o;
+            int depth = 0;
+            size_t nodes = 0;
+            uint64_t allocated = 0; // estimated, or the thread counter at the start with JSON_ALLOC_STATS
+            state(const json::decode_options& o) : o(o) {}
+        };
+        thread_local state* current = nullptr; // null when decoding without limits
+        struct scope {
+            state* saved;
+            scope(state* l) : saved(current) { current = l; }
+            ~scope() { current = saved; }
+        };
+        // about 16 parse tree nodes per element, the failed attempts of cases() included, and the value
+        const size_t per_node = 16 * (sizeof(ast) + 2 * sizeof(void*) + 2 * sizeof(int)) + sizeof(json::value) + control_block;
+        void string(int pos, size_t n) {
+            if(current && current->o.max_string && n > current->o.max_string) throw exceeded{ "string", pos };
+        }
+        rule nested(const rule& r, char open) { // depth of arrays and objects
+            return [=](const char* s, int i) {
+                state* l = current;
+                if(!l || !l->o.max_depth || s[i] != open) return r(s, i);
+                if(++l->depth > l->o.max_depth) throw exceeded{ "depth", i };
+                ptr<ast> a = r(s, i);
+                l->depth--;
+                return a;
+            };
+        }
+        rule counted(const rule& r) { // nodes and allocated bytes of every element parsed
+            return [=](const char* s, int i) {
+                ptr<ast> a = r(s, i);
+                state* l = current;
+                if(!l || isfail(a)) return a;
+                const json::decode_options& o = l->o;
+                if(o.max_nodes && ++l->nodes > o.max_nodes) throw exceeded{ "nodes", i };
+                if(o.max_allocated) {
+                #ifdef JSON_ALLOC_STATS
+                    uint64_t used = alloc::allocated - l->allocated;
+                #else
+                    bool text = s[i] == '"' || (s[i] >= '0' && s[i] <= '9'); // the parse tree and the value both hold a copy
+                    uint64_t used = l->allocated += per_node + (text? 2 * a->length : 0);
+                #endif
+                    if(used > o.max_allocated) throw exceeded{ "allocated", i };
+                }
+                return a;
+            };
+        }
+    };
 
     // manual regex because it is too slow
     ptr<ast> wsmatch(const char* s, int i) {
@@ -254,7 +1460,7 @@ namespace json_internals {
             if(e >= '0' && e <= '9') continue;
             if(e == '.') continue;
             if(c == i) return fail(i, i, tag);
-            return ptr<ast>(new ast(i, c - i, c, tag, {}, str(s, i, c - i)));
+            return ptr<ast>(new ast(i, c - i, c, tag, {}, str(s + i, c - i)));
         }
     }
     ptr<ast> strmatch(const char* s, int i) {
@@ -263,30 +1469,203 @@ namespace json_internals {
         for(int c = i + 1; ; c++) {
             if(s[c] == '\\') { c++; continue; }
             if(s[c] == 0) return fail(i, c, tag);
-            if(s[c] == '"') return ptr<ast>(new ast(i, c + 1 - i, c, tag, {}, str(s, i, c + 1 - i)));
+            if(s[c] == '"') {
+                limits::string(i, c - i - 1); // before the copy
+                return ptr<ast>(new ast(i, c + 1 - i, c, tag, {}, str(s + i, c + 1 - i)));
+            }
         }
         // never
     }
 
+    // build with -DJSON_METRICS to record every decode and encode into thread local shards
+    // a shard has a single writer, so recording is a relaxed load and store per counter, no locks and no lock prefix
+    // json::metrics() sums the shards under the registry mutex; a finished thread leaves its shard, counts included,
+    // to the next thread that starts recording, so there are never more shards than threads recording at once
+    namespace metrics {
+        enum counter { decodes, decode_errors, encodes, intern_hits, intern_misses, counters };
+    #ifdef JSON_METRICS
+        typedef std::atomic<uint64_t> cell;
+        void bump(cell& c, uint64_t n = 1) {
+            c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        struct histogram { // log-linear like hdr histograms, 8 sub-buckets per power of two, 12.5% resolution
+            static const int size = 496;
+            cell b[size];
+            histogram() { for(auto& e : b) e.store(0, std::memory_order_relaxed); }
+            static int msb(uint64_t v) { // the highest set bit of v > 0, a single instruction where the compiler has one
+            #if defined(__GNUC__) || defined(__clang__)
+                return 63 - __builtin_clzll(v);
+            #else
+                int e = 0;
+                while(v >>= 1) e++;
+                return e;
+            #endif
+            }
+            static int bucket(uint64_t v) {
+                if(v < 8) return (int)v;
+                int e = msb(v);
+                return (e - 2) * 8 + (int)((v >> (e - 3)) - 8);
+            }
+            static uint64_t upper(int i) { // largest value of bucket i
+                if(i < 8) return i;
+                int e = i / 8 + 2;
+                return ((uint64_t)(9 + i % 8) << (e - 3)) - 1;
+            }
+            void record(uint64_t v) { bump(b[bucket(v)]); }
+        };
+        struct shard {
+            histogram decode_ns, decode_bytes, encode_ns, encode_bytes;
+            histogram error_position; // where failed decodes stopped
+            cell c[counters];
+            shard() { for(auto& e : c) e.store(0, std::memory_order_relaxed); }
+        };
+        struct registry {
+            std::mutex m;
+            vector<ptr<shard>> shards; // every shard made, summed by json::metrics()
+            vector<shard*> idle;       // left by finished threads
+            ptr<shard> exiting;        // for what threads record after leaving their shard, may lose counts
+            registry() : exiting(new shard()) { shards.push_back(exiting); }
+        };
+        registry& global() {
+            static registry* r = new registry(); // never destroyed, threads may record during exit
+            return *r;
+        }
+        shard* adopt() {
+            registry& g = global();
+            std::lock_guard<std::mutex> l(g.m);
+            if(g.idle.empty()) {
+                g.shards.push_back(ptr<shard>(new shard()));
+                return g.shards.back().get();
+            }
+            shard* s = g.idle.back();
+            g.idle.pop_back();
+            return s;
+        }
+        void abandon(shard* s) {
+            registry& g = global();
+            std::lock_guard<std::mutex> l(g.m);
+            g.idle.push_back(s);
+        }
+        bool& gone() { // trivially destructible, still readable while the thread_local destructors run
+            thread_local bool g = false;
+            return g;
+        }
+        struct holder { // leaves the shard of a thread when it finishes
+            shard* s = nullptr;
+            ~holder() {
+                if(s) abandon(s);
+                gone() = true;
+            }
+        };
+        shard& local() {
+            if(gone()) return *global().exiting;
+            thread_local holder h;
+            if(!h.s) h.s = adopt();
+            return *h.s;
+        }
+        uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        void count(counter c, uint64_t n = 1) {
+            bump(local().c[c], n);
+        }
+        ptr<json::value> report(const vector<uint64_t>& b) {
+            uint64_t n = 0, sum = 0;
+            for(size_t i = 0; i < b.size(); i++) {
+                n += b[i];
+                sum += b[i] * histogram::upper(i);
+            }
+            auto q = [&](double p) -> uint64_t {
+                uint64_t seen = 0;
+                for(size_t i = 0; i < b.size(); i++) {
+                    seen += b[i];
+                    if(n && seen >= p * n) return histogram::upper(i);
+                }
+                return 0;
+            };
+            auto buckets = json::array({});
+            for(size_t i = 0; i < b.size(); i++) {
+                if(b[i]) buckets->array.push_back(json::array({ json::number(histogram::upper(i)), json::number(b[i]) }));
+            }
+            return json::object({
+                { "count",   json::number(n) },
+                { "mean",    json::number(n? (double)sum / n : 0) },
+                { "p50",     json::number(q(0.5)) },
+                { "p90",     json::number(q(0.9)) },
+                { "p99",     json::number(q(0.99)) },
+                { "p999",    json::number(q(0.999)) },
+                { "max",     json::number(q(1)) },
+                { "buckets", buckets } // [upper bound, count]
+            });
+        }
+    #else
+        void count(counter, uint64_t = 1) {}
+    #endif
+    };
+
+    // build with -DJSON_CAPTURE and call json::capture() to append sampled decode inputs to a corpus file
+    // a record is the input length in decimal, a newline, the input bytes and a newline, bench/replay.cpp reads it back
+    namespace capture {
+    #ifdef JSON_CAPTURE
+        struct state {
+            std::mutex m;
+            std::atomic<bool> on{ false };
+            std::atomic<size_t> max_record{ 0 }; // copies of the options decode reads without the lock
+            std::atomic<double> fraction{ 0 };
+            std::atomic<bool> scrub{ false };
+            json::capture_options o;            // under the lock
+            FILE* f = nullptr;
+            size_t written = 0;
+        };
+        state& global() {
+            static state* s = new state(); // never destroyed, decode may run during exit
+            return *s;
+        }
+        bool sampled(double fraction) {
+            thread_local uint64_t x = 0x9e3779b97f4a7c15ull ^ (uint64_t)(uintptr_t)&x;
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            return (x >> 11) * (1.0 / 9007199254740992.0) < fraction;
+        }
+        void offer(const str& s) { // called by decode
+            state& g = global();
+            if(!g.on.load(std::memory_order_relaxed)) return;
+            if(s.size() > g.max_record.load(std::memory_order_relaxed) || !sampled(g.fraction.load(std::memory_order_relaxed))) return;
+            str record = g.scrub.load(std::memory_order_relaxed)? json::scrub(s) : s;
+            str head = std::to_string(record.size()) + "\n";
+            std::lock_guard<std::mutex> l(g.m);
+            if(!g.f || g.written + head.size() + record.size() + 1 > g.o.max_bytes) return;
+            fwrite(head.data(), 1, head.size(), g.f);
+            fwrite(record.data(), 1, record.size(), g.f);
+            fputc('\n', g.f);
+            fflush(g.f);
+            g.written += head.size() + record.size() + 1;
+        }
+    #else
+        void offer(const str&) {}
+    #endif
+    };
+
     namespace parser {
-        rule element_ptr();
+        const rule& element_ptr();
         // rule ws      = regex("^([ \\t\\r\\n,])*", "ws");
         // rule number  = regex("^((0[xX][0-9a-fA-F]+)|(\\d+(\\.\\d+)?))", "number");
         // rule string  = regex("^([\"'])((\\\\(\\1|\\\\))|.)*?\\1", "string");
-        rule ws      = wsmatch;
+        rule ws      = traced("ws", wsmatch);
         rule boolean = cases({ token("true"), token("false") }, "boolean");
-        rule number  = nummatch;
-        rule string  = strmatch;
+        rule number  = traced("number", nummatch);
+        rule string  = traced("string", strmatch);
         rule member  = all({ string, ws, token(":"), ws, lazy(element_ptr) });
-        rule array   = all({ token("["), ws, many(all({ lazy(element_ptr), ws })), ws, token("]") }, "array");
-        rule object  = all({ token("{"), ws, many(all({ member,            ws })), ws, token("}") }, "object");
-        rule element = cases({ array, object, string, boolean, number }, "element");
-        rule element_ptr() { return element; }
+        rule array   = limits::nested(all({ token("["), ws, many(all({ lazy(element_ptr), ws })), ws, token("]") }, "array"), '[');
+        rule object  = limits::nested(all({ token("{"), ws, many(all({ member,            ws })), ws, token("}") }, "object"), '{');
+        rule element = limits::counted(cases({ array, object, string, boolean, number }, "element"));
+        const rule& element_ptr() { return element; }
     };
 
     namespace decoder {
         using namespace json;
-        ptr<value> element(const ptr<ast>& ast);
+        ptr<value> element(const ptr<ast>& ast, json::decode_stats& st, int depth);
         ptr<value> boolean(const ptr<ast>& ast) {
             return json::boolean(ast->data[0]->text == "true");
         }
@@ -294,29 +1673,46 @@ namespace json_internals {
             return json::number(std::stod(ast->text));
         }
         ptr<value> string(const ptr<ast>& ast) {
+            alloc::tag t(alloc::string);
             return json::string(ast->text.substr(1, ast->text.size() - 2));
         }
-        ptr<value> array(const ptr<ast>& ast) {
+        ptr<value> array(const ptr<ast>& ast, json::decode_stats& st, int depth) {
             ptr<value> v = json::array({});
+            {
+                alloc::tag t(alloc::vector);
+                v->array.reserve(ast->data[2]->data.size());
+            }
             for(auto& e : ast->data[2]->data) {
-                v->array.push_back(element(e->data[0]));
+                ptr<value> c = element(e->data[0], st, depth + 1);
+                alloc::tag t(alloc::vector);
+                v->array.push_back(c);
             }
             return v;
         }
-        ptr<value> object(const ptr<ast>& ast) {
+        ptr<value> object(const ptr<ast>& ast, json::decode_stats& st, int depth) {
             ptr<value> v = json::object({});
+            {
+                alloc::tag t(alloc::hash);
+                v->object.vector().reserve(ast->data[2]->data.size());
+            }
             for(auto& e : ast->data[2]->data) {
-                str key = e->data[0]->data[0]->text;
-                v->object.vector().push_back({ key.substr(1, key.size() - 2), element(e->data[0]->data[4]) });
+                ptr<value> c = element(e->data[0]->data[4], st, depth + 1);
+                alloc::tag t(alloc::hash);
+                const str& key = e->data[0]->data[0]->text;
+                v->object.vector().push_back({ key.substr(1, key.size() - 2), c });
             }
+            alloc::tag t(alloc::hash);
+            v->object.rehash();
             return v;
         }
-        ptr<value> element(const ptr<ast>& ast) {
-            if(ast->data[0]->tag == "boolean") return boolean(ast->data[0]);
-            if(ast->data[0]->tag == "number")  return number(ast->data[0]);
-            if(ast->data[0]->tag == "string")  return string(ast->data[0]);
-            if(ast->data[0]->tag == "array")   return array(ast->data[0]);
-            if(ast->data[0]->tag == "object")  return object(ast->data[0]);
+        ptr<value> element(const ptr<ast>& ast, json::decode_stats& st, int depth) {
+            st.nodes++;
+            if(depth > st.depth) st.depth = depth;
+            if(ast->data[0]->tag == "boolean") { st.booleans++; return boolean(ast->data[0]); }
+            if(ast->data[0]->tag == "number")  { st.numbers++;  return number(ast->data[0]); }
+            if(ast->data[0]->tag == "string")  { st.strings++;  return string(ast->data[0]); }
+            if(ast->data[0]->tag == "array")   { st.arrays++;   return array(ast->data[0], st, depth); }
+            if(ast->data[0]->tag == "object")  { st.objects++;  return object(ast->data[0], st, depth); }
             abort();
         }
     };
@@ -341,37 +1737,668 @@ namespace json_internals {
             }
             if(v->type == "object") {
                 os << tab << "{" << std::endl;
-                int i = 1;
-                for(auto& e : v->object.vector()) {
-                    os << tab << "    \"" << e.first << "\":" << std::endl;
-                    encodeos(e.second, tab + "        ", os, i < v->object.vector().size());
+                size_t i = 1;
+                size_t n = v->object.size();
+                v->object.each([&](const str& k, const ptr<value>& e) { // read only, the tree may be shared by threads
+                    os << tab << "    \"" << k << "\":" << std::endl;
+                    encodeos(e, tab + "        ", os, i < n);
                     i++;
-                }
+                });
                 os << tab << "}" << comma(c);
             }
         }
+        void quoted(const str& s, std::ostream& os) { // escapes as written, except for raw line breaks
+            os << "\"";
+            for(char c : s) {
+                if(c == '\n') os << "\\n";
+                else if(c == '\r') os << "\\r";
+                else os << c;
+            }
+            os << "\"";
+        }
+        void fixed(double n, std::ostream& os) { // the fewest of 15 to 17 significant digits that read back, without an exponent
+            int e = n == 0 || !std::isfinite(n)? 0 : (int)std::floor(std::log10(std::fabs(n)));
+            char buf[400];
+            for(int digits = 15; digits <= 17; digits++) {
+                snprintf(buf, sizeof(buf), "%.*f", e >= digits - 1? 0 : digits - 1 - e, n);
+                if(strtod(buf, nullptr) == n) break;
+            }
+            str r = buf;
+            if(r.find('.') != str::npos) {
+                r.erase(r.find_last_not_of('0') + 1);
+                if(r.back() == '.') r.pop_back();
+            }
+            os << r;
+        }
+        void encodeline(const ptr<value>& v, std::ostream& os) {
+            if(v->type == "boolean") os << (v->boolean? "true" : "false");
+            if(v->type == "number")  fixed(v->number, os);
+            if(v->type == "string")  quoted(v->string, os);
+            if(v->type == "array") {
+                os << "[";
+                for(size_t i = 0; i < v->array.size(); i++) {
+                    if(i) os << ",";
+                    encodeline(v->array[i], os);
+                }
+                os << "]";
+            }
+            if(v->type == "object") {
+                os << "{";
+                bool first = true;
+                v->object.each([&](const str& k, const ptr<value>& e) {
+                    if(!first) os << ",";
+                    first = false;
+                    quoted(k, os);
+                    os << ":";
+                    encodeline(e, os);
+                });
+                os << "}";
+            }
+        }
     };
 };
 
 namespace json {
     using namespace json_internals;
     decoded decode(const std::string& s) {
+        return decode(s, decode_options());
+    }
+    decoded decode(const std::string& s, const decode_options& o) {
+        // probes: decode__start(input bytes), decode__end(bytes consumed, nodes), decode__error(input bytes, error position)
         decoded r;
-        ptr<ast> ast = parser::element(s.c_str(), 0);
+        JSON_PROBE1(decode__start, s.size());
+        capture::offer(s);
+    #ifdef JSON_METRICS
+        uint64_t started = metrics::now();
+    #endif
+    #ifdef JSON_ALLOC_STATS
+        uint64_t allocated = alloc::allocated;
+    #endif
+        uint64_t t0 = ticks();
+        alloc::tag t(alloc::ast);
+        ptr<ast> ast;
+        limits::state l(o);
+    #ifdef JSON_ALLOC_STATS
+        l.allocated = allocated;
+    #endif
+        if(o.max_bytes && s.size() > o.max_bytes) {
+            ast = fail(o.max_bytes, o.max_bytes, "");
+            r.limit = "bytes";
+        }
+        else {
+            limits::scope g(o.max_depth || o.max_nodes || o.max_string || o.max_allocated? &l : nullptr);
+            try {
+                ast = parser::element(s.c_str(), 0);
+            }
+            catch(const limits::exceeded& e) {
+                ast = fail(e.pos, e.pos, "");
+                r.limit = e.limit;
+            }
+        }
+        uint64_t t1 = ticks();
+        r.stats.scan_ticks = t1 - t0;
         if(isfail(ast)) {
             r.error = ast->error;
-            return r;
+            r.stats.bytes = ast->error;
+            JSON_PROBE2(decode__error, s.size(), r.error);
         }
-        r.error = -1;
-        r.value = decoder::element(ast);
+        else {
+            r.error = -1;
+            r.stats.bytes = ast->length;
+            alloc::tag b(alloc::value);
+            r.value = decoder::element(ast, r.stats, 1);
+            r.stats.build_ticks = ticks() - t1;
+            JSON_PROBE2(decode__end, r.stats.bytes, r.stats.nodes);
+        }
+    #ifdef JSON_ALLOC_STATS
+        r.stats.allocated = alloc::allocated - allocated;
+    #endif
+    #ifdef JSON_METRICS
+        metrics::shard& m = metrics::local();
+        m.decode_ns.record(metrics::now() - started);
+        m.decode_bytes.record(s.size());
+        metrics::bump(m.c[metrics::decodes]);
+        if(r.error != -1) {
+            metrics::bump(m.c[metrics::decode_errors]);
+            m.error_position.record(r.error);
+        }
+    #endif
         return r;
     }
     std::string encode(const std::shared_ptr<value>& v) {
+        // probes: encode__start(root value), encode__end(output bytes)
+        JSON_PROBE1(encode__start, v.get());
+    #ifdef JSON_METRICS
+        uint64_t started = metrics::now();
+    #endif
+        alloc::tag t(alloc::string);
         std::ostringstream s;
         // s.precision(20);
         encoder::encodeos(v, "", s, false);
+        std::string r = s.str();
+        JSON_PROBE1(encode__end, r.size());
+    #ifdef JSON_METRICS
+        metrics::shard& m = metrics::local();
+        m.encode_ns.record(metrics::now() - started);
+        m.encode_bytes.record(r.size());
+        metrics::bump(m.c[metrics::encodes]);
+    #endif
+        return r;
+    }
+
+    std::string encode_line(const std::shared_ptr<value>& v) {
+        alloc::tag t(alloc::string);
+        std::ostringstream s;
+        encoder::encodeline(v, s);
         return s.str();
     }
+
+    std::shared_ptr<value> metrics() {
+        std::shared_ptr<value> r = object({});
+    #ifdef JSON_METRICS
+        using namespace json_internals::metrics;
+        typedef json_internals::metrics::histogram histogram;
+        vector<vector<uint64_t>> h(5, vector<uint64_t>(histogram::size, 0));
+        vector<uint64_t> c(counters, 0);
+        {
+            std::lock_guard<std::mutex> g(global().m);
+            for(auto& s : global().shards) {
+                const histogram* all[] = { &s->decode_ns, &s->decode_bytes, &s->encode_ns, &s->encode_bytes, &s->error_position };
+                for(int k = 0; k < 5; k++) {
+                    for(int i = 0; i < histogram::size; i++) h[k][i] += all[k]->b[i].load(std::memory_order_relaxed);
+                }
+                for(int i = 0; i < counters; i++) c[i] += s->c[i].load(std::memory_order_relaxed);
+            }
+        }
+        uint64_t lookups = c[intern_hits] + c[intern_misses];
+        r->object["decode"] = object({
+            { "count",      number(c[decodes]) },
+            { "errors",     number(c[decode_errors]) },
+            { "latency_ns", report(h[0]) },
+            { "bytes",      report(h[1]) },
+            { "error_position", report(h[4]) }
+        });
+        r->object["encode"] = object({
+            { "count",      number(c[encodes]) },
+            { "latency_ns", report(h[2]) },
+            { "bytes",      report(h[3]) }
+        });
+        r->object["intern"] = object({
+            { "hits",     number(c[intern_hits]) },
+            { "misses",   number(c[intern_misses]) },
+            { "hit_rate", number(lookups? (double)c[intern_hits] / lookups : 0) }
+        });
+    #endif
+        return r;
+    }
+    namespace memory_internals {
+        typedef std::pair<size_t, std::string> heavy;
+        std::string escape(const std::string& k) { // json pointer reference token
+            std::string r;
+            for(char c : k) {
+                if(c == '~') r += "~0";
+                else if(c == '/') r += "~1";
+                else r += c;
+            }
+            return r;
+        }
+        struct walk {
+            memory m;
+            size_t top;
+            std::vector<heavy> heap; // min heap of the top subtrees
+            std::unordered_set<const value*> seen;
+            size_t sso = std::string().capacity();
+            size_t str(const std::string& s) { return s.capacity() > sso? s.capacity() + 1 : 0; }
+            size_t node(const std::shared_ptr<value>& p, const std::string& path) { // bytes of the subtree
+                const value* v = p.get();
+                if(!seen.insert(v).second) return 0;
+                size_t inline_slots = v->array.inline_capacity() * sizeof(std::shared_ptr<value>)
+                                    + v->object.inline_capacity() * sizeof(std::pair<std::string, std::shared_ptr<value>>);
+                size_t bytes = sizeof(value) + inline_slots + json_internals::control_block;
+                m.nodes += sizeof(value) + inline_slots;
+                m.control += json_internals::control_block;
+                size_t s = str(v->type) + str(v->string);
+                m.strings += s;
+                bytes += s;
+                if(v->array.spilled()) {
+                    size_t used = v->array.size() * sizeof(v->array[0]);
+                    size_t cap = v->array.capacity() * sizeof(v->array[0]);
+                    m.children += used;
+                    m.slack += cap - used;
+                    bytes += cap;
+                }
+                for(size_t i = 0; i < v->array.size(); i++) bytes += node(v->array[i], path + "/" + std::to_string(i));
+                size_t slack = 0, keys = 0, index = 0;
+                size_t h = v->object.heap_bytes(&slack, &keys, &index);
+                m.strings += keys;
+                m.slack += slack;
+                m.index += index;
+                m.children += h - slack - keys - index;
+                bytes += h;
+                v->object.each([&](const std::string& k, const std::shared_ptr<value>& e) { bytes += node(e, path + "/" + escape(k)); });
+                if(top > 0 && !path.empty()) {
+                    heap.push_back({ bytes, path });
+                    std::push_heap(heap.begin(), heap.end(), std::greater<heavy>());
+                    if(heap.size() > top) {
+                        std::pop_heap(heap.begin(), heap.end(), std::greater<heavy>());
+                        heap.pop_back();
+                    }
+                }
+                return bytes;
+            }
+        };
+    };
+    memory memory_usage(const std::shared_ptr<value>& v, size_t top) {
+        memory_internals::walk w;
+        w.top = top;
+        w.m.total = w.node(v, "");
+        std::sort(w.heap.begin(), w.heap.end(), std::greater<memory_internals::heavy>());
+        for(auto& e : w.heap) w.m.top.push_back({ e.second, e.first });
+        return w.m;
+    }
+    namespace path_internals {
+        struct sample { // what this thread has spent so far
+            uint64_t ticks = 0;
+            uint64_t allocs = 0;
+            uint64_t allocated = 0;
+        };
+        sample now() {
+            sample r;
+        #ifdef JSON_ALLOC_STATS
+            r.allocs = alloc::allocations;
+            r.allocated = alloc::allocated;
+        #endif
+            r.ticks = json_internals::ticks();
+            return r;
+        }
+        uint64_t less(uint64_t a, uint64_t b) { return a > b? a - b : 0; } // timer noise can make children cost more than their parent
+        sample less(const sample& a, const sample& b) {
+            sample r;
+            r.ticks = less(a.ticks, b.ticks);
+            r.allocs = less(a.allocs, b.allocs);
+            r.allocated = less(a.allocated, b.allocated);
+            return r;
+        }
+        sample& operator += (sample& a, const sample& b) {
+            a.ticks += b.ticks;
+            a.allocs += b.allocs;
+            a.allocated += b.allocated;
+            return a;
+        }
+        struct spent { // inclusive costs of an element, returned to its parent
+            sample scan;
+            sample total; // scan, build and the profiling itself
+            size_t bytes = 0;
+        };
+        // the scan cost of an element is measured by parsing its subtree again on its own,
+        // so the profile costs about one extra parse per nesting level
+        struct walk {
+            const char* src;
+            path_profile& p;
+            decode_stats& st;
+            std::unordered_map<std::string, size_t> at; // path -> position in p.paths
+            walk(const char* src, path_profile& p, decode_stats& st) : src(src), p(p), st(st) {}
+            std::shared_ptr<value> element(const ptr<ast>& a, const std::string& path, int depth, spent& out) {
+                auto f = at.find(path);
+                if(f == at.end()) {
+                    f = at.insert({ path, p.paths.size() }).first;
+                    p.paths.push_back({ path, path_profile::entry() });
+                }
+                size_t slot = f->second;
+                sample begin = now();
+                {
+                    alloc::tag t(alloc::ast);
+                    parser::element(src, a->pos);
+                }
+                sample scanned = now();
+                out.scan = less(scanned, begin);
+                out.bytes = a->length;
+                spent children;
+                std::shared_ptr<value> v;
+                st.nodes++;
+                if(depth > st.depth) st.depth = depth;
+                const ptr<ast>& e = a->data[0];
+                if(e->tag == "boolean") { st.booleans++; v = decoder::boolean(e); }
+                if(e->tag == "number")  { st.numbers++;  v = decoder::number(e); }
+                if(e->tag == "string")  { st.strings++;  v = decoder::string(e); }
+                if(e->tag == "array") {
+                    st.arrays++;
+                    v = json::array({});
+                    {
+                        alloc::tag t(alloc::vector);
+                        v->array.reserve(e->data[2]->data.size());
+                    }
+                    for(auto& c : e->data[2]->data) {
+                        spent s;
+                        std::shared_ptr<value> child = element(c->data[0], path + "/*", depth + 1, s);
+                        alloc::tag t(alloc::vector);
+                        v->array.push_back(child);
+                        add(children, s);
+                    }
+                }
+                if(e->tag == "object") {
+                    st.objects++;
+                    v = json::object({});
+                    {
+                        alloc::tag t(alloc::hash);
+                        v->object.vector().reserve(e->data[2]->data.size());
+                    }
+                    for(auto& c : e->data[2]->data) {
+                        const str& key = c->data[0]->data[0]->text;
+                        std::string k = key.substr(1, key.size() - 2);
+                        spent s;
+                        std::shared_ptr<value> child = element(c->data[0]->data[4], path + "/" + memory_internals::escape(k), depth + 1, s);
+                        alloc::tag t(alloc::hash);
+                        v->object.vector().push_back({ k, child });
+                        add(children, s);
+                    }
+                    alloc::tag t(alloc::hash);
+                    v->object.rehash();
+                }
+                sample end = now();
+                out.total = less(end, begin);
+                sample scan = less(out.scan, children.scan);
+                sample build = less(less(end, scanned), children.total);
+                path_profile::entry& r = p.paths[slot].second; // looked up again, the children may have grown p.paths
+                r.nodes++;
+                r.bytes += less(out.bytes, children.bytes);
+                r.scan_ticks += scan.ticks;
+                r.build_ticks += build.ticks;
+                r.allocs += scan.allocs + build.allocs;
+                r.allocated += scan.allocated + build.allocated;
+                st.build_ticks += build.ticks;
+                st.allocated += scan.allocated + build.allocated; // self costs add up to about one decode
+                return v;
+            }
+            void add(spent& a, const spent& b) {
+                a.scan += b.scan;
+                a.total += b.total;
+                a.bytes += b.bytes;
+            }
+        };
+    };
+    decoded decode_profiled(const std::string& s, path_profile& p) {
+        decoded r;
+        uint64_t t0 = ticks();
+        alloc::tag t(alloc::ast);
+        ptr<ast> ast = parser::element(s.c_str(), 0);
+        r.stats.scan_ticks = ticks() - t0;
+        if(isfail(ast)) {
+            r.error = ast->error;
+            r.stats.bytes = ast->error;
+            return r;
+        }
+        r.error = -1;
+        r.stats.bytes = ast->length;
+        alloc::tag b(alloc::value);
+        path_internals::walk w(s.c_str(), p, r.stats);
+        for(size_t i = 0; i < p.paths.size(); i++) w.at[p.paths[i].first] = i; // a profile can add up several decodes
+        path_internals::spent root;
+        r.value = w.element(ast, "", 1, root);
+        return r;
+    }
+    // the copy is made in depth first order, so with the pool the nodes of a subtree end up next to each other
+    // nodes shared within the tree stay shared, dedup also shares string nodes with equal contents, std::string
+    // cannot share its buffer so the node is what is shared
+    struct compactor::state {
+        struct frame {
+            value* from;
+            value* to;
+            size_t next; // child to copy, arrays only
+        };
+        bool dedup;
+        std::shared_ptr<value> copy;
+        std::vector<frame> stack;
+        std::unordered_map<const value*, std::shared_ptr<value>> shared; // copies of nodes with more than one owner
+        std::unordered_map<std::string, std::shared_ptr<value>> strings;
+        std::shared_ptr<value> clone(const std::shared_ptr<value>& p) {
+            bool many = p.use_count() > 1;
+            if(many) {
+                auto f = shared.find(p.get());
+                if(f != shared.end()) return f->second;
+            }
+            if(dedup && p->type == "string") {
+                auto f = strings.find(p->string);
+                metrics::count(f != strings.end()? metrics::intern_hits : metrics::intern_misses);
+                if(f != strings.end()) return f->second;
+            }
+            std::shared_ptr<value> v = p->type == "array"? json_internals::node<json_internals::array_node>()
+                                     : p->type == "object"? json_internals::node<json_internals::object_node>() : json_internals::node();
+            v->type = p->type;
+            v->boolean = p->boolean;
+            v->number = p->number;
+            v->string = p->string; // a copy has no spare capacity
+            if(p->type == "array") {
+                v->array.reserve(p->array.size());
+                stack.push_back({ p.get(), v.get(), 0 });
+            }
+            if(p->type == "object") {
+                v->object.reserve(p->object.size());
+                stack.push_back({ p.get(), v.get(), 0 });
+            }
+            if(many) shared[p.get()] = v;
+            if(dedup && p->type == "string") strings[p->string] = v;
+            return v;
+        }
+    };
+    compactor::compactor(std::shared_ptr<value>& root, bool dedup) : root(root), s(new state()) {
+        s->dedup = dedup;
+    }
+    compactor::~compactor() {}
+    bool compactor::step(size_t budget) {
+        if(!s) return true;
+    #ifdef JSON_POOL
+        json_internals::pool::fresh f; // new slab space rather than recycled blocks scattered over old slabs
+    #endif
+        if(!s->copy && budget > 0) {
+            s->copy = s->clone(root);
+            budget--;
+        }
+        while(!s->stack.empty() && budget > 0) {
+            state::frame t = s->stack.back();
+            if(t.from->type == "array") {
+                if(t.next == t.from->array.size()) {
+                    s->stack.pop_back();
+                    continue;
+                }
+                s->stack.back().next++;
+                t.to->array.push_back(s->clone(t.from->array[t.next])); // may push the frame of the child
+            }
+            else { // all entries at once through a read only walk, readers may still share the source
+                s->stack.pop_back();
+                size_t first = s->stack.size();
+                t.from->object.each([&](const std::string& k, const std::shared_ptr<value>& e) {
+                    t.to->object.vector().push_back({ k, s->clone(e) });
+                });
+                t.to->object.rehash();
+                std::reverse(s->stack.begin() + first, s->stack.end()); // the first child is copied next
+                budget -= std::min(budget, t.to->object.size());
+                continue;
+            }
+            budget--;
+        }
+        if(!s->copy || !s->stack.empty()) return false;
+        root = s->copy;
+        s.reset();
+        return true;
+    }
+    void compact(std::shared_ptr<value>& v, bool dedup) {
+        compactor c(v, dedup);
+        while(!c.step(SIZE_MAX));
+    }
+    std::string path_profile::folded(const std::string& weight) const {
+        std::string r;
+        for(auto& e : paths) {
+            const entry& c = e.second;
+            uint64_t n = c.scan_ticks + c.build_ticks;
+            if(weight == "scan_ticks") n = c.scan_ticks;
+            if(weight == "build_ticks") n = c.build_ticks;
+            if(weight == "nodes") n = c.nodes;
+            if(weight == "bytes") n = c.bytes;
+            if(weight == "allocs") n = c.allocs;
+            if(weight == "allocated") n = c.allocated;
+            if(n == 0) continue;
+            std::string stack = "$"; // one frame per reference token, the last space of a line separates the weight
+            for(char ch : e.first) {
+                if(ch == '/') stack += ';';
+                else stack += ch == ';' || ch == '\n' || ch == '\r'? '_' : ch;
+            }
+            r += stack + " " + std::to_string(n) + "\n";
+        }
+        return r;
+    }
+    bool capture(const capture_options& o) {
+    #ifdef JSON_CAPTURE
+        json_internals::capture::state& g = json_internals::capture::global();
+        std::lock_guard<std::mutex> l(g.m);
+        if(g.f) fclose(g.f);
+        g.o = o;
+        g.max_record.store(o.max_record, std::memory_order_relaxed);
+        g.fraction.store(o.fraction, std::memory_order_relaxed);
+        g.scrub.store(o.scrub, std::memory_order_relaxed);
+        g.f = fopen(o.path.c_str(), "ab"); // append only, earlier records are never rewritten
+        g.written = 0;
+        if(g.f) {
+            fseek(g.f, 0, SEEK_END);
+            g.written = ftell(g.f);
+        }
+        g.on.store(g.f != nullptr, std::memory_order_relaxed);
+        return g.f != nullptr;
+    #else
+        (void)o;
+        return false;
+    #endif
+    }
+    void capture_stop() {
+    #ifdef JSON_CAPTURE
+        json_internals::capture::state& g = json_internals::capture::global();
+        std::lock_guard<std::mutex> l(g.m);
+        g.on.store(false, std::memory_order_relaxed);
+        if(g.f) fclose(g.f);
+        g.f = nullptr;
+    #endif
+    }
+    std::string scrub(const std::string& s) {
+        std::string r = s;
+        size_t n = r.size();
+        for(size_t i = 0; i < n; i++) {
+            char c = r[i];
+            if(c == '"') {
+                size_t end = i + 1;
+                while(end < n && r[end] != '"') end += r[end] == '\\'? 2 : 1;
+                size_t next = end + 1;
+                while(next < n && (r[next] == ' ' || r[next] == '\t' || r[next] == '\r' || r[next] == '\n')) next++;
+                bool key = next < n && r[next] == ':';
+                if(!key) {
+                    for(size_t k = i + 1; k < end && k < n; k++) r[k] = 'x'; // same length, escapes included
+                }
+                i = end;
+            }
+            else if(c >= '0' && c <= '9') {
+                bool first = i == 0 || !(r[i - 1] >= '0' && r[i - 1] <= '9');
+                r[i] = first? '1' : '0';
+            }
+        }
+        return r;
+    }
+    void metrics_reset() { // concurrent recording may survive a reset, it is not a barrier
+    #ifdef JSON_METRICS
+        using namespace json_internals::metrics;
+        std::lock_guard<std::mutex> g(global().m);
+        for(auto& s : global().shards) {
+            histogram* all[] = { &s->decode_ns, &s->decode_bytes, &s->encode_ns, &s->encode_bytes, &s->error_position };
+            for(auto h : all) {
+                for(auto& e : h->b) e.store(0, std::memory_order_relaxed);
+            }
+            for(auto& e : s->c) e.store(0, std::memory_order_relaxed);
+        }
+    #endif
+    }
+
+    alloc_scope::alloc_scope(alloc_stats& stats) {
+    #ifdef JSON_ALLOC_STATS
+        saved = alloc::sink;
+        alloc::sink = &stats;
+    #else
+        (void)stats;
+        saved = nullptr;
+    #endif
+    }
+    alloc_scope::~alloc_scope() {
+    #ifdef JSON_ALLOC_STATS
+        alloc::sink = saved;
+    #endif
+    }
+};
+
+#ifdef JSON_ALLOC_STATS
+// the global allocation functions are replaced in the translation unit that includes json.hpp
+// every block carries a 16 byte header with the stats it was counted in, its size and its category
+namespace json_internals {
+    namespace alloc {
+        json::alloc_stats::counter json::alloc_stats::* const counters[] = {
+            &json::alloc_stats::other, &json::alloc_stats::ast, &json::alloc_stats::value,
+            &json::alloc_stats::string, &json::alloc_stats::vector, &json::alloc_stats::hash
+        };
+        struct header {
+            json::alloc_stats* owner;
+            size_t size_category; // size << 3 | category
+        };
+        void count(json::alloc_stats::counter& c, size_t n) {
+            c.allocs++;
+            c.bytes += n;
+            c.live += n;
+            if(c.live > c.peak) c.peak = c.live;
+        }
+        void uncount(json::alloc_stats::counter& c, size_t n) {
+            c.frees++;
+            c.live -= n;
+        }
+        void* allocate(size_t n) {
+            header* h = static_cast<header*>(malloc(sizeof(header) + (n? n : 1)));
+            if(!h) return nullptr;
+            h->owner = sink;
+            h->size_category = n << 3 | current;
+            allocated += n;
+            allocations++;
+            if(sink) {
+                count(sink->*counters[current], n);
+                count(sink->total, n);
+            }
+            return h + 1;
+        }
+        void release(void* p) {
+            if(!p) return;
+            header* h = static_cast<header*>(p) - 1;
+            if(h->owner && h->owner == sink) { // blocks of another or a finished scope are not counted
+                size_t n = h->size_category >> 3;
+                uncount(sink->*counters[h->size_category & 7], n);
+                uncount(sink->total, n);
+            }
+            free(h);
+        }
+    };
 };
+void* operator new(size_t n) {
+    void* p = json_internals::alloc::allocate(n);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t n) {
+    return operator new(n);
+}
+void* operator new(size_t n, const std::nothrow_t&) noexcept {
+    return json_internals::alloc::allocate(n);
+}
+void* operator new[](size_t n, const std::nothrow_t&) noexcept {
+    return json_internals::alloc::allocate(n);
+}
+void operator delete(void* p) noexcept { json_internals::alloc::release(p); }
+void operator delete[](void* p) noexcept { json_internals::alloc::release(p); }
+void operator delete(void* p, size_t) noexcept { json_internals::alloc::release(p); }
+void operator delete[](void* p, size_t) noexcept { json_internals::alloc::release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { json_internals::alloc::release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { json_internals::alloc::release(p); }
+#endif
 
 #endif
\ No newline at end of file
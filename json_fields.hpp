@@ -0,0 +1,470 @@
+// secondary indexes over a json::ndjson::store, finding records by the value at a json pointer without a scan
+// an update projects the chosen pointers out of every record appended since the last one, on all cores, and writes
+// them as one sorted run of (pointer, value, sequence number); a lookup binary searches every run, and once there
+// are more than a few runs they are merged into one
+// POSIX only, alongside json_ndjson.hpp
+
+#ifndef JSON_FIELDS_HPP
+#define JSON_FIELDS_HPP
+
+#include "json_ndjson.hpp"
+#include "json_tape.hpp" // for its json pointer tokens
+#include <thread>
+#include <functional>
+#include <queue>
+#include <cstdio>
+
+// -----------------------------------
+//             PUBLIC API
+// -----------------------------------
+
+namespace json {
+    namespace ndjson {
+        // path + ".fields" is the manifest, path + ".fields.<n>" the runs, path is usually that of the store
+        // values compare as json: strings as written between the quotes, numbers by value, arrays and objects
+        // as their json::encode_line, which is how the store writes them
+        class field_index {
+            struct state;
+            std::unique_ptr<state> s;
+            public:
+                field_index();
+                ~field_index();
+                field_index(const field_index&) = delete;
+                field_index& operator = (const field_index&) = delete;
+                // the pointers are fixed when the index is created, false when an existing one was built for others
+                // a manifest that does not read back is treated as absent and the store is indexed again
+                bool open(const std::string& path, const std::vector<std::string>& pointers);
+                void close();
+                // indexes the records appended to st since the last update, threads 0 is one per core,
+                // one update at a time, finds may run meanwhile and see the index as it was before
+                // false when a file cannot be written, the index then still covers what it did before
+                bool update(const store& st, unsigned threads = 0);
+                uint64_t covered() const; // records indexed
+                std::vector<uint64_t> find(const std::string& pointer, const std::shared_ptr<value>& v) const; // ascending
+        };
+    };
+};
+
+// --------------------------------------------------------
+// ---------------- PRIVATE IMPLEMENTATION ----------------
+// --------------------------------------------------------
+
+namespace json_fields_internals {
+    // json pointers as a tree of reference tokens, matched against a line in one pass that builds nothing,
+    // subtrees no pointer goes into are skipped by counting brackets
+    struct projection {
+        struct node {
+            std::vector<std::pair<std::string, size_t>> next; // token and node
+            int field = -1;                                   // the pointer ending here
+        };
+        std::vector<node> nodes; // the root first
+        projection(const std::vector<std::string>& pointers) : nodes(1) {
+            std::vector<std::string> path;
+            for(size_t f = 0; f < pointers.size(); f++) {
+                if(!json_tape_internals::tokens(pointers[f], path)) continue; // matches nothing
+                size_t k = 0;
+                for(auto& token : path) {
+                    size_t next = child(k, token.data(), token.size());
+                    if(next == 0) {
+                        next = nodes.size();
+                        nodes.emplace_back();
+                        nodes[k].next.emplace_back(token, next);
+                    }
+                    k = next;
+                }
+                nodes[k].field = (int)f;
+            }
+        }
+        size_t child(size_t k, const char* token, size_t n) const { // 0 when there is none
+            for(auto& e : nodes[k].next) {
+                if(e.first.size() == n && memcmp(e.first.data(), token, n) == 0) return e.second;
+            }
+            return 0;
+        }
+        // f(field, offset, length) for every pointer found in s, which returns false to stop there,
+        // false when s is malformed or f stopped
+        template <typename F> bool run(const char* s, size_t n, F f) const {
+            size_t i = 0;
+            ws(s, n, i);
+            return value(s, n, i, 0, f);
+        }
+        static void ws(const char* s, size_t n, size_t& i) {
+            while(i < n && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r' || s[i] == ',')) i++;
+        }
+        static bool quoted(const char* s, size_t n, size_t& i) {
+            if(i >= n || s[i] != '"') return false;
+            size_t c = i + 1;
+            while(c < n && s[c] != '"') c += s[c] == '\\'? 2 : 1;
+            if(c >= n) return false;
+            i = c + 1;
+            return true;
+        }
+        static bool skip(const char* s, size_t n, size_t& i) {
+            if(i >= n) return false;
+            if(s[i] == '"') return quoted(s, n, i);
+            if(s[i] == '[' || s[i] == '{') {
+                int depth = 0;
+                while(i < n) {
+                    char c = s[i];
+                    if(c == '"') {
+                        if(!quoted(s, n, i)) return false;
+                        continue;
+                    }
+                    if(c == '[' || c == '{') depth++;
+                    else if((c == ']' || c == '}') && --depth == 0) {
+                        i++;
+                        return true;
+                    }
+                    i++;
+                }
+                return false;
+            }
+            size_t b = i;
+            while(i < n && ((s[i] >= '0' && s[i] <= '9') || s[i] == '.' || (s[i] >= 'a' && s[i] <= 'z'))) i++;
+            return i > b;
+        }
+        template <typename F> bool value(const char* s, size_t n, size_t& i, size_t k, F& f) const {
+            const node& e = nodes[k];
+            size_t begin = i;
+            if(e.next.empty() || i >= n || (s[i] != '[' && s[i] != '{')) {
+                if(!skip(s, n, i)) return false;
+            }
+            else if(s[i] == '{') {
+                i++;
+                ws(s, n, i);
+                while(i < n && s[i] != '}') {
+                    size_t key = i + 1;
+                    if(!quoted(s, n, i)) return false;
+                    size_t next = child(k, s + key, i - key - 1);
+                    ws(s, n, i);
+                    if(i >= n || s[i] != ':') return false;
+                    i++;
+                    ws(s, n, i);
+                    if(!(next? value(s, n, i, next, f) : skip(s, n, i))) return false;
+                    ws(s, n, i);
+                }
+                if(i++ >= n) return false;
+            }
+            else {
+                i++;
+                ws(s, n, i);
+                char token[24];
+                for(size_t at = 0; i < n && s[i] != ']'; at++) {
+                    size_t next = child(k, token, snprintf(token, sizeof(token), "%zu", at));
+                    if(!(next? value(s, n, i, next, f) : skip(s, n, i))) return false;
+                    ws(s, n, i);
+                }
+                if(i++ >= n) return false;
+            }
+            return e.field < 0 || f(e.field, begin, i - begin);
+        }
+    };
+
+    // the form a value is compared in, its kind then its text
+    std::string key(const char* p, size_t n) {
+        if(n >= 2 && p[0] == '"') return "s" + std::string(p + 1, n - 2);
+        if(p[0] == 't' || p[0] == 'f') return "b" + std::string(p, n);
+        if(p[0] == '[' || p[0] == '{') return "j" + std::string(p, n);
+        return "n" + json::encode_line(json::number(strtod(std::string(p, n).c_str(), nullptr)));
+    }
+    std::string key(const std::shared_ptr<json::value>& v) {
+        if(v->type == "string") return "s" + v->string;
+        if(v->type == "boolean") return v->boolean? "btrue" : "bfalse";
+        if(v->type == "number") return "n" + json::encode_line(v);
+        return "j" + json::encode_line(v);
+    }
+
+    // a run is a 24 byte header, "JSONFLD1", the number of entries and the position of their table, then the entries,
+    // each the pointer and the key length as 32 bit words, the sequence number and the key, then the table, the position
+    // of every entry in (pointer, key, sequence number) order
+    const char magic[8] = { 'J', 'S', 'O', 'N', 'F', 'L', 'D', '1' };
+    const size_t header = 24;
+    const size_t max_runs = 8; // more after an update are merged into one
+    struct entry {
+        uint32_t field;
+        const char* key;
+        uint32_t size;
+        uint64_t seq;
+    };
+    int compare(uint32_t field, const char* key, size_t size, const entry& e) {
+        if(field != e.field) return field < e.field? -1 : 1;
+        int c = memcmp(key, e.key, std::min(size, (size_t)e.size));
+        if(c != 0) return c;
+        return size == e.size? 0 : size < e.size? -1 : 1;
+    }
+    bool less(const entry& a, const entry& b) {
+        int c = compare(a.field, a.key, a.size, b);
+        return c != 0? c < 0 : a.seq < b.seq;
+    }
+    struct run {
+        uint64_t id = 0;
+        std::shared_ptr<json_ndjson_internals::view> v;
+        uint64_t count = 0;
+        const uint64_t* table = nullptr;
+        entry at(uint64_t k) const {
+            const char* p = v->p + table[k];
+            entry e;
+            memcpy(&e.field, p, 4);
+            memcpy(&e.size, p + 4, 4);
+            memcpy(&e.seq, p + 8, 8);
+            e.key = p + 16;
+            return e;
+        }
+        bool open(const std::string& file) {
+            int fd = ::open(file.c_str(), O_RDONLY);
+            if(fd == -1) return false;
+            v = std::make_shared<json_ndjson_internals::view>(fd, json_ndjson_internals::file_size(fd));
+            ::close(fd); // the mapping stays
+            uint64_t at = 0;
+            if(!v->p || v->n < header || memcmp(v->p, magic, 8) != 0) return false;
+            memcpy(&count, v->p + 8, 8);
+            memcpy(&at, v->p + 16, 8);
+            if(at % 8 != 0 || at > v->n || (v->n - at) / 8 < count) return false;
+            table = reinterpret_cast<const uint64_t*>(v->p + at);
+            return true;
+        }
+    };
+    // merges sorted sources into a run file, a source is a function that fills the next entry or returns false
+    bool write(const std::string& file, std::vector<std::function<bool(entry&)>>& sources) {
+        FILE* out = fopen(file.c_str(), "wb");
+        if(!out) return false;
+        std::vector<uint64_t> table;
+        uint64_t at = header;
+        bool ok = fwrite(magic, 1, 8, out) == 8 && fwrite(&at, 1, 8, out) == 8 && fwrite(&at, 1, 8, out) == 8;
+        typedef std::pair<entry, size_t> head;
+        auto later = [](const head& a, const head& b) { return less(b.first, a.first); };
+        std::priority_queue<head, std::vector<head>, decltype(later)> q(later);
+        entry e;
+        for(size_t k = 0; k < sources.size(); k++) {
+            if(sources[k](e)) q.push(head(e, k));
+        }
+        while(ok && !q.empty()) {
+            head h = q.top();
+            q.pop();
+            table.push_back(at);
+            ok = fwrite(&h.first.field, 1, 4, out) == 4 && fwrite(&h.first.size, 1, 4, out) == 4 && fwrite(&h.first.seq, 1, 8, out) == 8
+                && fwrite(h.first.key, 1, h.first.size, out) == h.first.size;
+            at += 16 + h.first.size;
+            if(sources[h.second](e)) q.push(head(e, h.second));
+        }
+        uint64_t pad = (8 - at % 8) % 8, zero = 0, count = table.size();
+        ok = ok && fwrite(&zero, 1, pad, out) == pad;
+        at += pad;
+        ok = ok && (table.empty() || fwrite(table.data(), 8, table.size(), out) == table.size());
+        ok = ok && fseek(out, 8, SEEK_SET) == 0 && fwrite(&count, 1, 8, out) == 8 && fwrite(&at, 1, 8, out) == 8;
+        ok = ok && fflush(out) == 0 && fdatasync(fileno(out)) == 0;
+        return fclose(out) == 0 && ok;
+    }
+};
+
+namespace json {
+    namespace ndjson {
+        struct field_index::state {
+            mutable std::mutex m; // guards runs and covered against finds during an update
+            std::string path;
+            std::vector<std::string> pointers;
+            uint64_t covered = 0;
+            uint64_t next = 0; // id of the next run
+            std::vector<json_fields_internals::run> runs;
+
+            std::string file(uint64_t id) const {
+                return path + ".fields." + std::to_string(id);
+            }
+            // replaces the manifest in one rename, so a crash leaves either the old or the new one
+            bool save(const std::vector<json_fields_internals::run>& r, uint64_t c) const {
+                std::vector<std::shared_ptr<value>> p, ids;
+                for(auto& e : pointers) p.push_back(string(e));
+                for(auto& e : r) ids.push_back(number((double)e.id));
+                std::string t = encode_line(object({ { "pointers", array(p) }, { "covered", number((double)c) },
+                                                     { "next", number((double)next) }, { "runs", array(ids) } })) + "\n";
+                std::string tmp = path + ".fields.tmp";
+                int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if(fd == -1) return false;
+                bool ok = json_ndjson_internals::put(fd, t.data(), t.size(), 0) && fdatasync(fd) == 0;
+                ok = ::close(fd) == 0 && ok;
+                return ok && rename(tmp.c_str(), (path + ".fields").c_str()) == 0;
+            }
+            // 1 when the manifest m was read, -1 when it is for other pointers,
+            // 0 when it is malformed or names a run that does not open
+            int load(const std::shared_ptr<value>& m) {
+                if(!m || m->type != "object") return 0;
+                auto member = [&](const char* k, const char* type) -> std::shared_ptr<value> {
+                    std::shared_ptr<value> v = m->object.has(k)? m->object[k] : nullptr;
+                    return v && v->type == type? v : nullptr;
+                };
+                auto whole = [](double d) { return d >= 0 && d <= 9007199254740992.0 && d == std::floor(d); };
+                std::shared_ptr<value> p = member("pointers", "array"), c = member("covered", "number"),
+                                       n = member("next", "number"), r = member("runs", "array");
+                if(!p || !c || !n || !r || !whole(c->number) || !whole(n->number)) return 0;
+                std::vector<std::string> found;
+                for(auto& e : p->array) {
+                    if(!e || e->type != "string") return 0;
+                    found.push_back(e->string);
+                }
+                if(found != pointers) return -1;
+                covered = (uint64_t)c->number;
+                next = (uint64_t)n->number;
+                for(auto& e : r->array) {
+                    if(!e || e->type != "number" || !whole(e->number) || e->number >= n->number) return 0;
+                    json_fields_internals::run f;
+                    f.id = (uint64_t)e->number;
+                    if(!f.open(file(f.id))) return 0;
+                    runs.push_back(f);
+                }
+                return 1;
+            }
+        };
+
+        field_index::field_index() {}
+        field_index::~field_index() {
+            close();
+        }
+        bool field_index::open(const std::string& path, const std::vector<std::string>& pointers) {
+            close();
+            for(auto& p : pointers) {
+                if(!p.empty() && p[0] != '/') return false;
+            }
+            std::unique_ptr<state> t(new state());
+            t->path = path;
+            t->pointers = pointers;
+            int fd = ::open((path + ".fields").c_str(), O_RDONLY);
+            if(fd == -1) {
+                if(!t->save(t->runs, 0)) return false;
+                s = std::move(t);
+                return true;
+            }
+            std::string text(json_ndjson_internals::file_size(fd), '\0');
+            ssize_t r = pread(fd, &text[0], text.size(), 0);
+            ::close(fd);
+            if(r != (ssize_t)text.size()) return false;
+            int loaded = t->load(decode(text).value);
+            if(loaded < 0) return false;
+            if(loaded == 0) { // as if there were no manifest, the next update indexes the store again
+                t->runs.clear();
+                t->covered = 0;
+                t->next = 0;
+                if(!t->save(t->runs, 0)) return false;
+            }
+            s = std::move(t);
+            return true;
+        }
+        void field_index::close() {
+            s.reset();
+        }
+        bool field_index::update(const store& st, unsigned threads) {
+            using namespace json_fields_internals;
+            if(!s) return false;
+            uint64_t begin = covered(), end = st.size();
+            if(begin >= end) return true;
+            if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+            threads = (unsigned)std::min<uint64_t>(threads, end - begin);
+            struct found {
+                uint32_t field;
+                std::string key;
+                uint64_t seq;
+            };
+            std::vector<std::vector<found>> parts(threads);
+            std::vector<std::thread> workers;
+            projection p(s->pointers);
+            for(unsigned t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    std::vector<found>& out = parts[t];
+                    uint64_t b = begin + (end - begin) * t / threads, e = begin + (end - begin) * (t + 1) / threads;
+                    st.scan(b, e, [&](uint64_t seq, const char* line, size_t n) {
+                        size_t mark = out.size();
+                        bool ok = p.run(line, n, [&](int field, size_t at, size_t size) {
+                            out.push_back({ (uint32_t)field, key(line + at, size), seq });
+                            return true;
+                        });
+                        if(!ok) out.resize(mark); // a malformed record indexes nothing
+                    });
+                    std::sort(out.begin(), out.end(), [](const found& a, const found& b) {
+                        if(a.field != b.field) return a.field < b.field;
+                        return a.key != b.key? a.key < b.key : a.seq < b.seq;
+                    });
+                });
+            }
+            for(auto& w : workers) w.join();
+            std::vector<std::function<bool(entry&)>> sources;
+            for(auto& part : parts) {
+                size_t k = 0;
+                sources.push_back([&part, k](entry& e) mutable {
+                    if(k == part.size()) return false;
+                    found& f = part[k++];
+                    e = { f.field, f.key.data(), (uint32_t)f.key.size(), f.seq };
+                    return true;
+                });
+            }
+            std::vector<run> runs;
+            {
+                std::lock_guard<std::mutex> l(s->m);
+                runs = s->runs;
+            }
+            run fresh;
+            fresh.id = s->next++;
+            if(!write(s->file(fresh.id), sources) || !fresh.open(s->file(fresh.id))) return false;
+            runs.push_back(fresh);
+            std::vector<run> old;
+            if(runs.size() > max_runs) { // merged into one, the old runs are removed once the manifest no longer names them
+                sources.clear();
+                for(auto& r : runs) {
+                    uint64_t k = 0;
+                    const run* from = &r;
+                    sources.push_back([from, k](entry& e) mutable {
+                        if(k == from->count) return false;
+                        e = from->at(k++);
+                        return true;
+                    });
+                }
+                run merged;
+                merged.id = s->next++;
+                if(!write(s->file(merged.id), sources) || !merged.open(s->file(merged.id))) return false;
+                old.swap(runs);
+                runs.push_back(merged);
+            }
+            if(!s->save(runs, end)) return false;
+            {
+                std::lock_guard<std::mutex> l(s->m);
+                s->runs = runs;
+                s->covered = end;
+            }
+            for(auto& r : old) unlink(s->file(r.id).c_str());
+            return true;
+        }
+        uint64_t field_index::covered() const {
+            if(!s) return 0;
+            std::lock_guard<std::mutex> l(s->m);
+            return s->covered;
+        }
+        std::vector<uint64_t> field_index::find(const std::string& pointer, const std::shared_ptr<value>& v) const {
+            using namespace json_fields_internals;
+            std::vector<uint64_t> r;
+            if(!s || !v) return r;
+            size_t field = std::find(s->pointers.begin(), s->pointers.end(), pointer) - s->pointers.begin();
+            if(field == s->pointers.size()) return r;
+            std::string k = key(v);
+            std::vector<run> runs;
+            {
+                std::lock_guard<std::mutex> l(s->m);
+                runs = s->runs;
+            }
+            for(auto& run : runs) {
+                uint64_t lo = 0, hi = run.count;
+                while(lo < hi) {
+                    uint64_t mid = lo + (hi - lo) / 2;
+                    if(compare((uint32_t)field, k.data(), k.size(), run.at(mid)) > 0) lo = mid + 1;
+                    else hi = mid;
+                }
+                for(; lo < run.count; lo++) {
+                    entry e = run.at(lo);
+                    if(compare((uint32_t)field, k.data(), k.size(), e) != 0) break;
+                    r.push_back(e.seq);
+                }
+            }
+            std::sort(r.begin(), r.end());
+            return r;
+        }
+    };
+};
+
+#endif
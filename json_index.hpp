@@ -0,0 +1,364 @@
+// persistent sidecar indexes for random access into large json files
+// json::sidecar::build scans a file once and writes the byte offsets of the children of every array and object
+// down to a depth, so a later process can jump to element 7000000 or to a key and decode only that slice
+// the index carries the size and an FNV-1a checksum of the file it was built from
+// POSIX only, it shares the scanner and the mappings of json_tape.hpp
+
+#ifndef JSON_INDEX_HPP
+#define JSON_INDEX_HPP
+
+#include "json_tape.hpp"
+#include <cstdio>
+
+// -----------------------------------
+//             PUBLIC API
+// -----------------------------------
+
+namespace json {
+    namespace sidecar {
+        // -1 when the index was written, the byte offset of a syntax error, or -2 when a file cannot be read or written
+        // depth 1 indexes the children of the root, 2 those of its containers too, and so on
+        int64_t build(const std::string& input, const std::string& index, int depth = 2);
+        class file;
+        class entry { // a node of the input, invalid when a lookup finds nothing
+            const file* f;
+            uint64_t at_offset; // in the input
+            uint64_t block;     // in the index, 0 when the node has no block
+            public:
+                entry(const file* f = nullptr, uint64_t offset = ~0ull, uint64_t block = 0);
+                explicit operator bool () const;
+                bool indexed() const; // children are looked up in the index, otherwise the input is scanned
+                std::string type() const; // as json::value::type, empty when invalid
+                uint64_t offset() const;
+                uint64_t size() const;
+                entry at(uint64_t n) const;                  // constant time when indexed
+                entry find(const std::string& key) const;    // keys compared as written, escapes included
+                entry pointer(const std::string& p) const;   // json pointer from this node
+                std::string text() const;                    // the input bytes of the node
+                std::shared_ptr<value> decode() const;       // the slice as a value, nullptr when invalid
+        };
+        class file { // an input and its index, mapped read only
+            friend class entry;
+            json_tape_internals::mapping in, idx;
+            uint64_t root_block = 0;
+            public:
+                file();
+                ~file();
+                file(const file&) = delete;
+                file& operator = (const file&) = delete;
+                // false when a file is missing or the index was not built from this input,
+                // the size is always compared, verify also reads the whole input to compare the checksum
+                bool open(const std::string& input, const std::string& index, bool verify = false);
+                void close();
+                entry root() const;
+        };
+    };
+};
+
+// --------------------------------------------------------
+// ---------------- PRIVATE IMPLEMENTATION ----------------
+// --------------------------------------------------------
+
+namespace json_index_internals {
+    namespace tape = json_tape_internals;
+    // the index is a 40 byte header, "JSONIDX1", the input size, its checksum, the depth and the position of the root block,
+    // then a block per indexed container in post order, so the block of a child is written before the entry that points to it;
+    // the entries of the open containers wait on one stack until their closing bracket, past 8MB its bottom goes to a file
+    // a block is the offset of the container, the offset of its closing bracket, its type in the low 3 bits with
+    // the number of children above them, and per child the offset of its key in objects, its offset and its block or 0
+    const char magic[8] = { 'J', 'S', 'O', 'N', 'I', 'D', 'X', '1' };
+    const size_t header = 40;
+
+    using tape::fnv1a;
+    uint64_t checksum(const tape::mapping& m) { // for verify, build folds it into its scan
+        return fnv1a(m.p, m.n);
+    }
+
+    // a stack of words whose bottom moves to an unlinked file once limit words are in memory, a container pops the
+    // entries it pushed when it closes, so the entries of each open container stay contiguous above those of its parent
+    class spill {
+        std::string path;
+        int fd = -1;
+        uint64_t flushed = 0;       // words in the file
+        std::vector<uint64_t> tail; // the words above them
+        public:
+            static const size_t limit = 1 << 20;
+            bool ok = true;
+            spill(const std::string& path) : path(path) {}
+            ~spill() {
+                if(fd != -1) ::close(fd);
+            }
+            spill(const spill&) = delete;
+            spill& operator = (const spill&) = delete;
+            uint64_t size() const { return flushed + tail.size(); }
+            void push(uint64_t w) {
+                tail.push_back(w);
+                if(tail.size() < limit) return;
+                if(fd == -1) {
+                    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+                    if(fd != -1) unlink(path.c_str());
+                }
+                size_t n = tail.size() * 8;
+                ok = ok && fd != -1 && pwrite(fd, tail.data(), n, flushed * 8) == (ssize_t)n;
+                flushed += tail.size();
+                tail.clear();
+            }
+            void set(uint64_t i, uint64_t w) {
+                if(i >= flushed) tail[i - flushed] = w;
+                else ok = ok && pwrite(fd, &w, 8, i * 8) == 8;
+            }
+            void pop(uint64_t from, FILE* f) { // writes the words from there up to f and removes them
+                uint64_t buf[4096];
+                for(uint64_t i = from; i < flushed && ok; ) {
+                    size_t n = (size_t)std::min<uint64_t>(4096, flushed - i);
+                    ok = pread(fd, buf, n * 8, i * 8) == (ssize_t)(n * 8) && fwrite(buf, 8, n, f) == n;
+                    i += n;
+                }
+                size_t t = from > flushed? from - flushed : 0;
+                if(t < tail.size()) ok = ok && fwrite(tail.data() + t, 8, tail.size() - t, f) == tail.size() - t;
+                if(from < flushed) {
+                    flushed = from;
+                    tail.clear();
+                }
+                else {
+                    tail.resize(from - flushed);
+                }
+            }
+    };
+
+    class builder { // a scanner sink writing the blocks
+        FILE* f;
+        int depth;
+        struct frame {
+            uint64_t offset;
+            uint64_t start; // of its entries in the spill stack
+            bool object;
+        };
+        std::vector<frame> stack; // the open containers that get a block
+        spill entries;
+        int below = 0;            // open containers deeper than depth
+        uint64_t key = 0;         // offset of the key of the next member
+        void child(uint64_t offset) {
+            if(below > 0 || stack.empty()) return;
+            if(stack.back().object) entries.push(key);
+            entries.push(offset);
+            entries.push(0);
+        }
+        public:
+            uint64_t written = header;
+            uint64_t root = 0;
+            bool ok = true;
+            builder(FILE* f, int depth, const std::string& spill_path) : f(f), depth(depth), entries(spill_path) {}
+            void leaf(uint64_t offset, uint64_t, int t) {
+                if(t == tape::key) key = offset;
+                else child(offset);
+            }
+            void open(uint64_t offset, int t) {
+                child(offset);
+                if(below > 0 || (int)stack.size() == depth) below++;
+                else stack.push_back({ offset, entries.size(), t == tape::object });
+            }
+            void close(uint64_t offset, uint64_t count, int t) {
+                if(below > 0) {
+                    below--;
+                    return;
+                }
+                frame c = stack.back();
+                stack.pop_back();
+                uint64_t words = entries.size() - c.start;
+                uint64_t head[3] = { c.offset, offset, count << 3 | t };
+                ok = ok && fwrite(head, 8, 3, f) == 3;
+                entries.pop(c.start, f);
+                if(!stack.empty()) entries.set(entries.size() - 1, written); // the block word of the entry of c in its parent
+                else root = written;
+                written += 8 * (3 + words);
+                ok = ok && entries.ok;
+            }
+    };
+
+    struct members { // a scanner sink collecting the children of the scanned container, for nodes without a block
+        int level = 0;
+        uint64_t key = 0;
+        std::vector<std::pair<uint64_t, uint64_t>> out; // key offset, value offset
+        void leaf(uint64_t offset, uint64_t, int t) {
+            if(level != 1) return;
+            if(t == tape::key) key = offset;
+            else out.push_back({ key, offset });
+        }
+        void open(uint64_t offset, int) {
+            if(level == 1) out.push_back({ key, offset });
+            level++;
+        }
+        void close(uint64_t, uint64_t, int) {
+            level--;
+        }
+    };
+    struct none { // a scanner sink for finding where a node ends
+        void leaf(uint64_t, uint64_t, int) {}
+        void open(uint64_t, int) {}
+        void close(uint64_t, uint64_t, int) {}
+    };
+    std::string quoted(const char* s, uint64_t n, uint64_t at) { // the key or string at, without its quotes
+        uint64_t c = at + 1;
+        while(c < n && s[c] != '"') c += s[c] == '\\'? 2 : 1;
+        return std::string(s + at + 1, (c < n? c : n) - at - 1);
+    }
+};
+
+namespace json {
+    namespace sidecar {
+        int64_t build(const std::string& input, const std::string& index, int depth) {
+            using namespace json_index_internals;
+            if(depth < 1) return -2;
+            json_tape_internals::mapping in;
+            if(!in.open(input)) return -2;
+            FILE* f = fopen(index.c_str(), "wb");
+            if(!f) {
+                in.release();
+                return -2;
+            }
+            if(in.p) madvise(const_cast<char*>(in.p), in.n, MADV_SEQUENTIAL);
+            uint64_t sum = fnv1a(nullptr, 0);
+            char head[header] = {};
+            bool ok = fwrite(head, 1, header, f) == header; // written last
+            builder b(f, depth, index + ".spill");
+            json_tape_internals::scanner<builder> sc(in.p, in.n, b);
+            sc.release = true;
+            sc.sum = &sum; // the checksum in the same pass as the scan
+            int64_t r = sc.run();
+            sum = fnv1a(in.p + sc.dropped, in.n - sc.dropped, sum); // what the scan kept in memory and anything after the root
+            uint64_t words[4] = { in.n, sum, (uint64_t)depth, b.root };
+            memcpy(head, magic, 8);
+            memcpy(head + 8, words, 32);
+            ok = ok && b.ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(head, 1, header, f) == header;
+            ok = fclose(f) == 0 && ok;
+            in.release();
+            if(r != -1) remove(index.c_str()); // no index for a broken input
+            return r != -1? r : ok? -1 : -2;
+        }
+
+        entry::entry(const file* f, uint64_t offset, uint64_t block) : f(f), at_offset(f && offset < f->in.n? offset : ~0ull), block(block) {}
+        entry::operator bool () const { return at_offset != ~0ull; }
+        bool entry::indexed() const { return *this && block != 0; }
+        uint64_t entry::offset() const { return at_offset; }
+        std::string entry::type() const {
+            if(!*this) return "";
+            char c = f->in.p[at_offset];
+            if(c == '[') return "array";
+            if(c == '{') return "object";
+            if(c == '"') return "string";
+            if(c == 't' || c == 'f') return "boolean";
+            return "number";
+        }
+        uint64_t entry::size() const {
+            if(indexed()) {
+                const uint64_t* b = reinterpret_cast<const uint64_t*>(f->idx.p + block);
+                return b[2] >> 3;
+            }
+            std::string t = type();
+            if(t != "array" && t != "object") return 0;
+            json_index_internals::members m;
+            json_tape_internals::scanner<json_index_internals::members> sc(f->in.p, f->in.n, m);
+            sc.i = at_offset;
+            sc.run();
+            return m.out.size();
+        }
+        entry entry::at(uint64_t n) const {
+            if(type() != "array") return entry();
+            if(indexed()) {
+                const uint64_t* b = reinterpret_cast<const uint64_t*>(f->idx.p + block);
+                if(n >= b[2] >> 3) return entry();
+                return entry(f, b[3 + 2 * n], b[3 + 2 * n + 1]);
+            }
+            json_index_internals::members m;
+            json_tape_internals::scanner<json_index_internals::members> sc(f->in.p, f->in.n, m);
+            sc.i = at_offset;
+            sc.run();
+            return n < m.out.size()? entry(f, m.out[n].second) : entry();
+        }
+        entry entry::find(const std::string& key) const {
+            using namespace json_index_internals;
+            if(type() != "object") return entry();
+            if(indexed()) {
+                const uint64_t* b = reinterpret_cast<const uint64_t*>(f->idx.p + block);
+                uint64_t n = b[2] >> 3;
+                for(uint64_t i = 0; i < n; i++) {
+                    const uint64_t* e = b + 3 + 3 * i;
+                    if(quoted(f->in.p, f->in.n, e[0]) == key) return entry(f, e[1], e[2]);
+                }
+                return entry();
+            }
+            members m;
+            json_tape_internals::scanner<members> sc(f->in.p, f->in.n, m);
+            sc.i = at_offset;
+            sc.run();
+            for(auto& e : m.out) {
+                if(quoted(f->in.p, f->in.n, e.first) == key) return entry(f, e.second);
+            }
+            return entry();
+        }
+        entry entry::pointer(const std::string& p) const {
+            std::vector<std::string> path;
+            if(!json_tape_internals::tokens(p, path)) return entry();
+            entry c = *this;
+            for(size_t i = 0; c && i < path.size(); i++) {
+                uint64_t n;
+                if(c.type() != "array") c = c.find(path[i]);
+                else if(json_tape_internals::index(path[i], n)) c = c.at(n);
+                else return entry();
+            }
+            return c;
+        }
+        std::string entry::text() const {
+            if(!*this) return "";
+            uint64_t end;
+            if(indexed()) {
+                end = reinterpret_cast<const uint64_t*>(f->idx.p + block)[1] + 1;
+            }
+            else {
+                json_index_internals::none n;
+                json_tape_internals::scanner<json_index_internals::none> sc(f->in.p, f->in.n, n);
+                sc.i = at_offset;
+                sc.run();
+                end = sc.i;
+            }
+            return std::string(f->in.p + at_offset, end - at_offset);
+        }
+        std::shared_ptr<value> entry::decode() const {
+            if(!*this) return nullptr;
+            return json::decode(text()).value;
+        }
+
+        file::file() {}
+        file::~file() {
+            close();
+        }
+        bool file::open(const std::string& input, const std::string& index, bool verify) {
+            using namespace json_index_internals;
+            close();
+            uint64_t words[4] = {};
+            bool ok = in.open(input) && idx.open(index) && idx.n >= header && memcmp(idx.p, magic, 8) == 0;
+            if(ok) memcpy(words, idx.p + 8, 32);
+            ok = ok && words[0] == in.n && words[3] < idx.n;
+            ok = ok && (!verify || checksum(in) == words[1]);
+            if(!ok) {
+                close();
+                return false;
+            }
+            madvise(const_cast<char*>(in.p), in.n, MADV_RANDOM);
+            madvise(const_cast<char*>(idx.p), idx.n, MADV_RANDOM);
+            root_block = words[3];
+            return true;
+        }
+        void file::close() {
+            in.release();
+            idx.release();
+            root_block = 0;
+        }
+        entry file::root() const {
+            return entry(this, 0, root_block);
+        }
+    };
+};
+
+#endif
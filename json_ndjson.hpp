@@ -0,0 +1,305 @@
+// an append only store of json records, one json::encode_line per line of a data file
+// a second file holds the end offset of every record, so record n is read through mmap without scanning the data
+// appends from any thread are made durable together, one fdatasync of each file covers every record that arrived
+// while the previous one was running; on open, index words an unsynced tail left wrong are dropped, lines written
+// after the last indexed one are indexed and a torn last line is cut
+// POSIX only, one process at a time holds a store open
+
+#ifndef JSON_NDJSON_HPP
+#define JSON_NDJSON_HPP
+
+#include "json.hpp"
+#ifdef _WIN32
+#error "json_ndjson.hpp needs mmap"
+#endif
+#include <mutex>
+#include <condition_variable>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// -----------------------------------
+//             PUBLIC API
+// -----------------------------------
+
+namespace json {
+    namespace ndjson {
+        struct store_options {
+            bool sync = true;          // append returns once its record is on disk, otherwise on commit()
+            size_t buffer = 1 << 20;   // bytes of unsynced appends held before they are written out
+        };
+        class store { // path holds the records, path + ".idx" their end offsets as 64 bit words
+            struct state;
+            std::unique_ptr<state> s;
+            public:
+                store();
+                ~store();
+                store(const store&) = delete;
+                store& operator = (const store&) = delete;
+                bool open(const std::string& path, const store_options& o = store_options()); // false when locked or unreadable
+                void close();
+                // the sequence number, ~0 when the store failed or v holds what the grammar cannot read back: a negative
+                // number, nan or inf, or a string or key with an unescaped quote, a trailing backslash or a control byte
+                // other than a line break; every record appended is one read() returns
+                uint64_t append(const std::shared_ptr<value>& v);
+                bool commit();                                    // writes and syncs every append so far
+                uint64_t size() const;                            // records
+                std::string line(uint64_t seq) const;             // empty when out of range
+                std::shared_ptr<value> read(uint64_t seq) const;  // nullptr when out of range
+                // f(seq, data, size) for the records in [begin, end) straight from the mapping, without copies,
+                // the pointers stay valid only during the call
+                template <typename F> void scan(uint64_t begin, uint64_t end, F f) const;
+        };
+    };
+};
+
+// --------------------------------------------------------
+// ---------------- PRIVATE IMPLEMENTATION ----------------
+// --------------------------------------------------------
+
+namespace json_ndjson_internals {
+    struct view { // the first n bytes of a file, readers keep an old view alive while a newer one replaces it
+        const char* p = nullptr;
+        size_t n = 0;
+        view(int fd, size_t n) : n(n) {
+            if(n == 0) return;
+            void* m = mmap(nullptr, n, PROT_READ, MAP_SHARED, fd, 0);
+            p = m == MAP_FAILED? nullptr : static_cast<const char*>(m);
+        }
+        ~view() {
+            if(p) munmap(const_cast<char*>(p), n);
+        }
+    };
+    bool put(int fd, const char* p, size_t n, uint64_t at) {
+        while(n > 0) {
+            ssize_t w = pwrite(fd, p, n, at);
+            if(w <= 0) return false;
+            p += w;
+            n -= w;
+            at += w;
+        }
+        return true;
+    }
+    // strings are held with their escapes as written and encode_line copies them, escaping only raw line breaks,
+    // so an unescaped quote or a trailing backslash would end or swallow the string, and other control bytes are not json
+    bool readable(const std::string& s) {
+        for(size_t i = 0; i < s.size(); i++) {
+            bool escaped = s[i] == '\\';
+            if(escaped && ++i == s.size()) return false;
+            if(s[i] == '"' && !escaped) return false;
+            if((unsigned char)s[i] < 0x20 && s[i] != '\n' && s[i] != '\r') return false;
+        }
+        return true;
+    }
+    bool readable(const std::shared_ptr<json::value>& v) { // by decode once encode_line wrote it
+        if(!v) return false;
+        if(v->type == "number") return std::isfinite(v->number) && !std::signbit(v->number);
+        if(v->type == "string") return readable(v->string);
+        bool ok = v->type == "boolean" || v->type == "array" || v->type == "object";
+        for(size_t i = 0; ok && i < v->array.size(); i++) ok = readable(v->array[i]);
+        v->object.each([&](const std::string& k, const std::shared_ptr<json::value>& e) { ok = ok && readable(k) && readable(e); });
+        return ok;
+    }
+    uint64_t file_size(int fd) {
+        struct stat st;
+        return fstat(fd, &st) == 0? st.st_size : 0;
+    }
+};
+
+namespace json {
+    namespace ndjson {
+        struct store::state {
+            std::mutex m;
+            std::condition_variable cv;
+            int data = -1;
+            int index = -1;
+            store_options o;
+            uint64_t records = 0;       // appended
+            uint64_t written = 0;       // in the files
+            uint64_t synced = 0;        // on disk
+            uint64_t bytes = 0;         // of the records appended
+            uint64_t written_bytes = 0;
+            std::string pending;        // lines not yet written
+            std::vector<uint64_t> ends; // of the pending lines
+            bool leader = false;        // a thread is writing
+            bool failed = false;
+            std::shared_ptr<json_ndjson_internals::view> records_view, index_view;
+
+            // writes the pending lines, and syncs the data then the index when sync is set, with the lock released meanwhile
+            // the index is written after the data is synced, so it never points past what survives a crash
+            bool write(std::unique_lock<std::mutex>& l, bool sync) {
+                while(leader) cv.wait(l);
+                if(failed) return false;
+                if(pending.empty() && (!sync || synced == written)) return true;
+                leader = true;
+                std::string d;
+                std::vector<uint64_t> e;
+                d.swap(pending);
+                e.swap(ends);
+                uint64_t at = written_bytes, first = written;
+                l.unlock();
+                bool ok = json_ndjson_internals::put(data, d.data(), d.size(), at);
+                ok = ok && (!sync || fdatasync(data) == 0);
+                ok = ok && json_ndjson_internals::put(index, reinterpret_cast<const char*>(e.data()), e.size() * 8, first * 8);
+                ok = ok && (!sync || fdatasync(index) == 0);
+                l.lock();
+                leader = false;
+                if(ok) {
+                    written += e.size();
+                    written_bytes += d.size();
+                    if(sync) synced = written;
+                }
+                failed = !ok;
+                cv.notify_all();
+                return ok;
+            }
+            // keeps the index words that are strictly increasing, within the data and end just after a line break, an
+            // unsynced index tail may hold zeros; then indexes the complete lines after the last kept one and cuts a torn
+            // last line; the index is read once, sequentially
+            bool recover() {
+                using namespace json_ndjson_internals;
+                uint64_t data_bytes = file_size(data);
+                uint64_t total = file_size(index) / 8, n = 0, end = 0;
+                std::vector<uint64_t> words(1 << 16);
+                for(uint64_t at = 0; at < total && n == at; at += words.size()) {
+                    size_t k = (size_t)std::min<uint64_t>(words.size(), total - at);
+                    if(pread(index, words.data(), k * 8, at * 8) != (ssize_t)(k * 8)) return false;
+                    for(size_t i = 0; i < k && words[i] > end && words[i] <= data_bytes; i++) {
+                        end = words[i];
+                        n++;
+                    }
+                }
+                while(n > 0) {
+                    char c;
+                    if(pread(data, &c, 1, end - 1) != 1) return false;
+                    if(c == '\n') break;
+                    n--;
+                    end = 0;
+                    if(n > 0 && pread(index, &end, 8, (n - 1) * 8) != 8) return false;
+                }
+                std::vector<uint64_t> found;
+                std::vector<char> buf(1 << 20);
+                uint64_t last = end;
+                for(uint64_t at = end; at < data_bytes;) {
+                    ssize_t r = pread(data, buf.data(), buf.size(), at);
+                    if(r <= 0) return false;
+                    for(ssize_t i = 0; i < r; i++) {
+                        if(buf[i] == '\n') found.push_back(last = at + i + 1);
+                    }
+                    at += r;
+                }
+                if(!put(index, reinterpret_cast<const char*>(found.data()), found.size() * 8, n * 8)) return false;
+                n += found.size();
+                if(ftruncate(index, n * 8) != 0 || ftruncate(data, last) != 0) return false;
+                if(fdatasync(data) != 0 || fdatasync(index) != 0) return false;
+                records = written = synced = n;
+                bytes = written_bytes = last;
+                return true;
+            }
+            // mappings that cover the first n records, writing buffered ones out first
+            bool views(std::unique_lock<std::mutex>& l, uint64_t n, std::shared_ptr<json_ndjson_internals::view>& i,
+                       std::shared_ptr<json_ndjson_internals::view>& d) {
+                if(n > written && !write(l, false)) return false;
+                if(!index_view || index_view->n < n * 8) {
+                    index_view.reset(new json_ndjson_internals::view(index, written * 8));
+                    records_view.reset(new json_ndjson_internals::view(data, written_bytes));
+                }
+                i = index_view;
+                d = records_view;
+                return n == 0 || (i->p && d->p);
+            }
+        };
+
+        store::store() {}
+        store::~store() {
+            close();
+        }
+        bool store::open(const std::string& path, const store_options& o) {
+            close();
+            std::unique_ptr<state> t(new state());
+            t->o = o;
+            t->data = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            t->index = ::open((path + ".idx").c_str(), O_RDWR | O_CREAT, 0644);
+            bool ok = t->data != -1 && t->index != -1 && flock(t->data, LOCK_EX | LOCK_NB) == 0 && t->recover();
+            if(!ok) {
+                if(t->data != -1) ::close(t->data);
+                if(t->index != -1) ::close(t->index);
+                return false;
+            }
+            s = std::move(t);
+            return true;
+        }
+        void store::close() {
+            if(!s) return;
+            commit();
+            fdatasync(s->index);
+            ::close(s->data); // releases the lock
+            ::close(s->index);
+            s.reset();
+        }
+        uint64_t store::append(const std::shared_ptr<value>& v) {
+            if(!s || !json_ndjson_internals::readable(v)) return ~0ull;
+            std::string line = encode_line(v);
+            std::unique_lock<std::mutex> l(s->m);
+            if(s->failed) return ~0ull;
+            uint64_t seq = s->records++;
+            s->pending += line;
+            s->pending += '\n';
+            s->bytes += line.size() + 1;
+            s->ends.push_back(s->bytes);
+            if(s->o.sync) {
+                while(s->synced <= seq && !s->failed) { // the first waiter without a running write becomes the leader
+                    if(!s->leader) s->write(l, true);
+                    else s->cv.wait(l);
+                }
+                return s->synced > seq? seq : ~0ull;
+            }
+            if(s->pending.size() >= s->o.buffer && !s->write(l, false)) return ~0ull;
+            return seq;
+        }
+        bool store::commit() {
+            if(!s) return false;
+            std::unique_lock<std::mutex> l(s->m);
+            return s->write(l, true);
+        }
+        uint64_t store::size() const {
+            if(!s) return 0;
+            std::lock_guard<std::mutex> l(s->m);
+            return s->records;
+        }
+        std::string store::line(uint64_t seq) const {
+            if(!s) return "";
+            std::unique_lock<std::mutex> l(s->m);
+            if(seq >= s->records) return "";
+            std::shared_ptr<json_ndjson_internals::view> index, records;
+            if(!s->views(l, seq + 1, index, records)) return "";
+            l.unlock();
+            const uint64_t* ends = reinterpret_cast<const uint64_t*>(index->p);
+            uint64_t begin = seq? ends[seq - 1] : 0;
+            return std::string(records->p + begin, ends[seq] - begin - 1);
+        }
+        std::shared_ptr<value> store::read(uint64_t seq) const {
+            std::string t = line(seq);
+            if(t.empty()) return nullptr;
+            return decode(t).value;
+        }
+        template <typename F> void store::scan(uint64_t begin, uint64_t end, F f) const {
+            if(!s) return;
+            std::unique_lock<std::mutex> l(s->m);
+            end = std::min(end, s->records);
+            if(begin >= end) return;
+            std::shared_ptr<json_ndjson_internals::view> index, records;
+            if(!s->views(l, end, index, records)) return;
+            l.unlock();
+            const uint64_t* ends = reinterpret_cast<const uint64_t*>(index->p);
+            for(uint64_t seq = begin; seq < end; seq++) {
+                uint64_t at = seq? ends[seq - 1] : 0;
+                f(seq, records->p + at, (size_t)(ends[seq] - at - 1));
+            }
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,183 @@
+// filtered scans of a json::ndjson::store on all cores
+// a predicate is a list of conditions on the values at json pointers, checked against the raw line with the
+// projection of json_fields.hpp, which skips what no pointer enters and stops at the first condition that fails;
+// only the records that match are decoded, the others are rejected without allocating
+// POSIX only, alongside json_ndjson.hpp
+
+#ifndef JSON_SELECT_HPP
+#define JSON_SELECT_HPP
+
+#include "json_fields.hpp"
+#include <atomic>
+
+// -----------------------------------
+//             PUBLIC API
+// -----------------------------------
+
+namespace json {
+    namespace ndjson {
+        // every condition must hold, a condition on a pointer the record lacks fails, where throws std::length_error
+        // on a 65th condition
+        // strings compare as written between the quotes byte by byte, numbers by value, booleans, arrays and
+        // objects only by equal and not_equal, and a value of another type is never equal
+        class predicate {
+            struct state;
+            std::unique_ptr<state> s;
+            public:
+                enum op { equal, not_equal, less, less_equal, greater, greater_equal, exists };
+                predicate();
+                ~predicate();
+                predicate(const predicate&) = delete;
+                predicate& operator = (const predicate&) = delete;
+                predicate& where(const std::string& pointer, op o, const std::shared_ptr<value>& v = nullptr);
+                bool operator () (const char* line, size_t n) const; // never allocates
+        };
+        // f(seq, record) for every matching record in [begin, end), called from the worker threads at once,
+        // threads 0 is one per core, the number of matches
+        template <typename F>
+        uint64_t scan(const store& st, const predicate& p, F f, unsigned threads = 0, uint64_t begin = 0, uint64_t end = ~0ull);
+        // the matching records in sequence order
+        std::vector<std::pair<uint64_t, std::shared_ptr<value>>> select(const store& st, const predicate& p, unsigned threads = 0);
+    };
+};
+
+// --------------------------------------------------------
+// ---------------- PRIVATE IMPLEMENTATION ----------------
+// --------------------------------------------------------
+
+namespace json_select_internals {
+    struct term {
+        size_t field;
+        json::ndjson::predicate::op o;
+        char kind;          // of the constant, as json_fields_internals::key
+        std::string text;   // strings between the quotes, the json of the others
+        double number = 0;
+    };
+    char kind(const char* p) {
+        if(p[0] == '"') return 's';
+        if(p[0] == 't' || p[0] == 'f') return 'b';
+        if(p[0] == '[' || p[0] == '{') return 'j';
+        return 'n';
+    }
+    bool holds(const term& t, const char* p, size_t n) {
+        typedef json::ndjson::predicate op; // for its enum
+        if(t.o == op::exists) return true;
+        char k = kind(p);
+        if(k != t.kind) return t.o == op::not_equal;
+        int c = 0;
+        if(k == 'n') {
+            char buf[64]; // numbers are digits and a dot, longer ones are cut
+            size_t m = std::min(n, sizeof(buf) - 1);
+            memcpy(buf, p, m);
+            buf[m] = '\0';
+            double d = strtod(buf, nullptr);
+            c = d < t.number? -1 : d > t.number? 1 : 0;
+        }
+        else {
+            if(k == 's') {
+                p++;
+                n -= 2;
+            }
+            c = memcmp(p, t.text.data(), std::min(n, t.text.size()));
+            if(c == 0) c = n < t.text.size()? -1 : n > t.text.size()? 1 : 0;
+            if(k != 's' && t.o != op::equal && t.o != op::not_equal) return false;
+        }
+        switch(t.o) {
+            case op::equal: return c == 0;
+            case op::not_equal: return c != 0;
+            case op::less: return c < 0;
+            case op::less_equal: return c <= 0;
+            case op::greater: return c > 0;
+            case op::greater_equal: return c >= 0;
+            default: return false;
+        }
+    }
+};
+
+namespace json {
+    namespace ndjson {
+        struct predicate::state {
+            std::vector<std::string> pointers;
+            std::vector<json_select_internals::term> terms;
+            std::unique_ptr<json_fields_internals::projection> p; // rebuilt by where
+        };
+
+        predicate::predicate() : s(new state()) {
+            s->p.reset(new json_fields_internals::projection(s->pointers));
+        }
+        predicate::~predicate() {}
+        predicate& predicate::where(const std::string& pointer, op o, const std::shared_ptr<value>& v) {
+            if(s->terms.size() == 64) throw std::length_error("json::ndjson::predicate holds at most 64 conditions");
+            json_select_internals::term t;
+            t.field = std::find(s->pointers.begin(), s->pointers.end(), pointer) - s->pointers.begin();
+            t.o = o;
+            t.kind = 0;
+            if(o != exists && v) {
+                t.kind = v->type == "string"? 's' : v->type == "boolean"? 'b' : v->type == "number"? 'n' : 'j';
+                t.text = v->type == "string"? v->string : encode_line(v);
+                t.number = v->number;
+            }
+            if(t.field == s->pointers.size()) {
+                s->pointers.push_back(pointer);
+                s->p.reset(new json_fields_internals::projection(s->pointers));
+            }
+            s->terms.push_back(t);
+            return *this;
+        }
+        bool predicate::operator () (const char* line, size_t n) const {
+            uint64_t all = s->terms.size() == 64? ~0ull : (1ull << s->terms.size()) - 1, held = 0;
+            bool failed = false;
+            s->p->run(line, n, [&](int field, size_t at, size_t size) {
+                for(size_t k = 0; k < s->terms.size(); k++) {
+                    const json_select_internals::term& t = s->terms[k];
+                    if(t.field != (size_t)field) continue;
+                    if(!json_select_internals::holds(t, line + at, size)) {
+                        failed = true;
+                        return false;
+                    }
+                    held |= 1ull << k;
+                }
+                return true;
+            });
+            return !failed && held == all; // a malformed line ends the walk early and misses some condition or fails one
+        }
+
+        template <typename F>
+        uint64_t scan(const store& st, const predicate& p, F f, unsigned threads, uint64_t begin, uint64_t end) {
+            end = std::min(end, st.size());
+            if(begin >= end) return 0;
+            if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+            threads = (unsigned)std::min<uint64_t>(threads, end - begin);
+            std::atomic<uint64_t> matches(0);
+            std::vector<std::thread> workers;
+            for(unsigned t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    uint64_t b = begin + (end - begin) * t / threads, e = begin + (end - begin) * (t + 1) / threads, found = 0;
+                    st.scan(b, e, [&](uint64_t seq, const char* line, size_t n) {
+                        if(!p(line, n)) return;
+                        std::shared_ptr<value> v = decode(std::string(line, n)).value;
+                        if(!v) return;
+                        found++;
+                        f(seq, v);
+                    });
+                    matches += found;
+                });
+            }
+            for(auto& w : workers) w.join();
+            return matches;
+        }
+        std::vector<std::pair<uint64_t, std::shared_ptr<value>>> select(const store& st, const predicate& p, unsigned threads) {
+            std::mutex m;
+            std::vector<std::pair<uint64_t, std::shared_ptr<value>>> r;
+            scan(st, p, [&](uint64_t seq, const std::shared_ptr<value>& v) {
+                std::lock_guard<std::mutex> l(m);
+                r.emplace_back(seq, v);
+            }, threads);
+            std::sort(r.begin(), r.end(), [](const std::pair<uint64_t, std::shared_ptr<value>>& a,
+                                             const std::pair<uint64_t, std::shared_ptr<value>>& b) { return a.first < b.first; });
+            return r;
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,445 @@
+// out of core documents for json.hpp
+// json::tape::build scans a mapped input once and writes its structure to a tape file, json::tape::document maps both
+// and walks them with cursors, so only the pages a query touches are resident and a document can be larger than memory
+// values are read straight from the input, json::tape::cursor::decode turns any subtree into a json::value
+// POSIX only, it needs mmap
+
+#ifndef JSON_TAPE_HPP
+#define JSON_TAPE_HPP
+
+#include "json.hpp"
+#ifdef _WIN32
+#error "json_tape.hpp needs mmap"
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// -----------------------------------
+//             PUBLIC API
+// -----------------------------------
+
+namespace json {
+    namespace tape {
+        // -1 when the tape was written, the byte offset of a syntax error, or -2 when a file cannot be read or written
+        int64_t build(const std::string& input, const std::string& tape);
+        class document;
+        class cursor { // a node of a document, invalid when a lookup finds nothing
+            const document* d;
+            uint64_t i; // tape index
+            public:
+                cursor(const document* d = nullptr, uint64_t i = ~0ull);
+                explicit operator bool () const;
+                std::string type() const; // as json::value::type, empty when invalid
+                uint64_t size() const;    // children of an array or object
+                uint64_t offset() const;  // in the input
+                cursor at(uint64_t n) const; // walks the children before n
+                cursor find(const std::string& key) const; // keys compared as written, escapes included
+                cursor pointer(const std::string& p) const; // json pointer from this node
+                template <typename F> void each(F f) const; // f(key, cursor) for every child until it returns false, keys are empty in arrays
+                bool boolean() const;
+                double number() const;
+                std::string string() const; // as the decoder, escapes are kept
+                std::string text() const;   // the input bytes of the node
+                std::shared_ptr<value> decode() const; // the subtree as a value, nullptr when invalid
+        };
+        class document { // the input and its tape, mapped read only
+            friend class cursor;
+            const char* in = nullptr;
+            size_t in_bytes = 0;
+            const char* map = nullptr;
+            size_t map_bytes = 0;
+            const uint64_t* tape = nullptr; // two words per entry
+            uint64_t entries = 0;
+            public:
+                document();
+                ~document();
+                document(const document&) = delete;
+                document& operator = (const document&) = delete;
+                bool open(const std::string& input, const std::string& tape); // false when a file is missing or the tape is not of this input
+                void close();
+                cursor root() const;
+        };
+    };
+};
+
+// --------------------------------------------------------
+// ---------------- PRIVATE IMPLEMENTATION ----------------
+// --------------------------------------------------------
+
+namespace json_tape_internals {
+    // the tape is a 16 byte header, "JSONTAPE" and the input size, then an entry per node in document order
+    // an entry is the byte offset of the node and a word of its type in the low 3 bits and a number above them:
+    //   boolean, number, string, key  the length in bytes, quotes included
+    //   array, object                 the tape index one past the subtree, children follow the entry
+    //   close                         the number of children, the offset is the one of the closing bracket
+    // a member of an object is a key entry followed by the entries of its value
+    enum type { boolean, number, string, array, object, key, close };
+    const char* names[] = { "boolean", "number", "string", "array", "object" };
+    const char magic[8] = { 'J', 'S', 'O', 'N', 'T', 'A', 'P', 'E' };
+    const size_t header = 16;
+    const size_t chunk = 64 << 20; // input pages behind the scan are dropped every chunk
+    bool nested(uint64_t word) {
+        return (word & 7) == array || (word & 7) == object;
+    }
+
+    struct mapping { // a whole file mapped read only
+        const char* p = nullptr;
+        size_t n = 0;
+        bool open(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if(fd == -1) return false;
+            struct stat st;
+            bool ok = fstat(fd, &st) == 0;
+            n = ok? st.st_size : 0;
+            if(ok && n > 0) {
+                void* m = mmap(nullptr, n, PROT_READ, MAP_SHARED, fd, 0);
+                ok = m != MAP_FAILED;
+                p = ok? static_cast<const char*>(m) : nullptr;
+            }
+            ::close(fd);
+            return ok;
+        }
+        void release() {
+            if(p) munmap(const_cast<char*>(p), n);
+            p = nullptr;
+            n = 0;
+        }
+    };
+
+    class writer { // the tape as a scanner sink, buffered, an entry still in the buffer is patched in place
+        int fd;
+        std::vector<uint64_t> buf;
+        uint64_t flushed = 0; // entries on disk
+        std::vector<uint64_t> opens; // tape indexes of the open containers
+        public:
+            bool ok = true;
+            writer(int fd) : fd(fd) {}
+            uint64_t size() const { return flushed + buf.size() / 2; }
+            void flush() {
+                size_t n = buf.size() * sizeof(uint64_t);
+                ok = ok && pwrite(fd, buf.data(), n, header + flushed * 16) == (ssize_t)n;
+                flushed += buf.size() / 2;
+                buf.clear();
+            }
+            void push(uint64_t offset, uint64_t word) {
+                buf.push_back(offset);
+                buf.push_back(word);
+                if(buf.size() == 2 * 65536) flush();
+            }
+            void patch(uint64_t i, uint64_t word) {
+                if(i >= flushed) buf[(i - flushed) * 2 + 1] = word;
+                else ok = ok && pwrite(fd, &word, 8, header + i * 16 + 8) == 8;
+            }
+            void leaf(uint64_t offset, uint64_t length, int t) {
+                push(offset, length << 3 | t);
+            }
+            void open(uint64_t offset, int t) {
+                opens.push_back(size());
+                push(offset, t);
+            }
+            void close(uint64_t offset, uint64_t count, int t) {
+                push(offset, count << 3 | json_tape_internals::close);
+                patch(opens.back(), size() << 3 | t);
+                opens.pop_back();
+            }
+    };
+
+    // the grammar of json.hpp without its parse tree: commas are whitespace, no null, no signs, no exponents
+    // the reference tokens of a json pointer with ~1 and ~0 unescaped, false when it does not start with a slash,
+    // shared by the pointer lookups of json_tape.hpp and json_index.hpp and the projections of json_fields.hpp
+    bool tokens(const std::string& p, std::vector<std::string>& out) {
+        out.clear();
+        size_t at = 0;
+        while(at < p.size()) {
+            if(p[at] != '/') return false;
+            size_t end = p.find('/', at + 1);
+            if(end == std::string::npos) end = p.size();
+            std::string token;
+            for(size_t k = at + 1; k < end; k++) {
+                if(p[k] == '~' && k + 1 < end && p[k + 1] == '1') { token += '/'; k++; }
+                else if(p[k] == '~' && k + 1 < end && p[k + 1] == '0') { token += '~'; k++; }
+                else token += p[k];
+            }
+            out.push_back(token);
+            at = end;
+        }
+        return true;
+    }
+    bool index(const std::string& token, uint64_t& n) { // an array index token, digits only
+        if(token.empty() || token.find_first_not_of("0123456789") != std::string::npos) return false;
+        n = strtoull(token.c_str(), nullptr, 10);
+        return true;
+    }
+    uint64_t fnv1a(const char* p, size_t n, uint64_t h = 14695981039346656037ull) {
+        for(size_t i = 0; i < n; i++) {
+            h ^= (unsigned char)p[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // every node is reported to the sink in document order, w.leaf(offset, length, type) for leaves and keys,
+    // w.open(offset, type) and w.close(offset of the bracket, children, type) around containers
+    template <typename Sink>
+    struct scanner {
+        const char* s;
+        uint64_t n;
+        uint64_t i = 0;
+        uint64_t dropped = 0; // input bytes released from memory
+        bool release = false; // for a scan over the whole input, see drop()
+        uint64_t* sum = nullptr; // with release, the FNV-1a of the released input is folded into it
+        Sink& w;
+        scanner(const char* s, uint64_t n, Sink& w) : s(s), n(n), w(w) {}
+        void ws() {
+            while(i < n && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n' || s[i] == ',')) i++;
+        }
+        bool quoted(int t) {
+            if(i >= n || s[i] != '"') return false;
+            uint64_t c = i + 1;
+            while(c < n && s[c] != '"') c += s[c] == '\\'? 2 : 1;
+            if(c >= n) {
+                i = n;
+                return false;
+            }
+            w.leaf(i, c + 1 - i, t);
+            i = c + 1;
+            return true;
+        }
+        bool leaf() {
+            if(i >= n) return false;
+            if(s[i] == '"') return quoted(string);
+            if(n - i >= 4 && memcmp(s + i, "true", 4) == 0) {
+                w.leaf(i, 4, boolean);
+                i += 4;
+                return true;
+            }
+            if(n - i >= 5 && memcmp(s + i, "false", 5) == 0) {
+                w.leaf(i, 5, boolean);
+                i += 5;
+                return true;
+            }
+            uint64_t c = i;
+            while(c < n && ((s[c] >= '0' && s[c] <= '9') || s[c] == '.')) c++;
+            if(c == i) return false;
+            w.leaf(i, c - i, number);
+            i = c;
+            return true;
+        }
+        void drop() { // clean pages of the input are free to reclaim, but madvise keeps the scan from filling memory with them
+            if(!release) return;
+            uint64_t page = sysconf(_SC_PAGESIZE);
+            uint64_t upto = i / page * page;
+            if(upto - dropped < chunk) return;
+            if(sum) *sum = fnv1a(s + dropped, upto - dropped, *sum); // while the pages are still in memory
+            madvise(const_cast<char*>(s) + dropped, upto - dropped, MADV_DONTNEED);
+            dropped = upto;
+        }
+        int64_t run() { // -1 or the error offset
+            struct frame {
+                uint64_t count;
+                char close;
+            };
+            std::vector<frame> stack;
+            for(;;) {
+                // a value at i
+                if(i < n && (s[i] == '[' || s[i] == '{')) {
+                    bool o = s[i] == '{';
+                    stack.push_back({ 0, o? '}' : ']' });
+                    w.open(i, o? object : array);
+                    i++;
+                    ws();
+                }
+                else if(!leaf()) {
+                    return i;
+                }
+                else if(stack.empty()) {
+                    return -1;
+                }
+                else {
+                    ws();
+                }
+                // the next child or the end of the containers at i
+                for(;;) {
+                    frame& f = stack.back();
+                    if(i < n && s[i] == f.close) {
+                        w.close(i, f.count, f.close == '}'? object : array);
+                        i++;
+                        stack.pop_back();
+                        if(stack.empty()) return -1;
+                        ws();
+                        continue;
+                    }
+                    f.count++;
+                    if(f.close == '}') {
+                        if(!quoted(key)) return i;
+                        ws();
+                        if(i >= n || s[i] != ':') return i;
+                        i++;
+                        ws();
+                    }
+                    break;
+                }
+                drop();
+            }
+        }
+    };
+};
+
+namespace json {
+    namespace tape {
+        int64_t build(const std::string& input, const std::string& tape) {
+            using namespace json_tape_internals;
+            mapping in;
+            if(!in.open(input)) return -2;
+            if(in.p) madvise(const_cast<char*>(in.p), in.n, MADV_SEQUENTIAL);
+            int fd = ::open(tape.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if(fd == -1) {
+                in.release();
+                return -2;
+            }
+            writer w(fd);
+            scanner<writer> sc(in.p, in.n, w);
+            sc.release = true;
+            int64_t r = sc.run();
+            w.flush();
+            char head[header];
+            uint64_t bytes = in.n;
+            memcpy(head, magic, 8);
+            memcpy(head + 8, &bytes, 8);
+            bool ok = w.ok && pwrite(fd, head, header, 0) == (ssize_t)header;
+            ok = ::close(fd) == 0 && ok;
+            in.release();
+            if(r != -1) unlink(tape.c_str()); // no tape for a broken input
+            return r != -1? r : ok? -1 : -2;
+        }
+
+        cursor::cursor(const document* d, uint64_t i) : d(d), i(d && i < d->entries? i : ~0ull) {}
+        cursor::operator bool () const { return i != ~0ull; }
+        std::string cursor::type() const {
+            return *this? json_tape_internals::names[d->tape[2 * i + 1] & 7] : "";
+        }
+        uint64_t cursor::size() const {
+            if(!*this || !json_tape_internals::nested(d->tape[2 * i + 1])) return 0;
+            return d->tape[2 * ((d->tape[2 * i + 1] >> 3) - 1) + 1] >> 3;
+        }
+        uint64_t cursor::offset() const {
+            return *this? d->tape[2 * i] : 0;
+        }
+        template <typename F>
+        void cursor::each(F f) const {
+            if(!*this || !json_tape_internals::nested(d->tape[2 * i + 1])) return;
+            bool object = (d->tape[2 * i + 1] & 7) == json_tape_internals::object;
+            uint64_t end = (d->tape[2 * i + 1] >> 3) - 1; // the close entry
+            for(uint64_t c = i + 1; c < end;) {
+                std::string k;
+                if(object) {
+                    uint64_t w = d->tape[2 * c + 1];
+                    k.assign(d->in + d->tape[2 * c] + 1, (w >> 3) - 2);
+                    c++;
+                }
+                uint64_t w = d->tape[2 * c + 1];
+                if(!f(k, cursor(d, c))) return;
+                c = json_tape_internals::nested(w)? w >> 3 : c + 1;
+            }
+        }
+        cursor cursor::at(uint64_t n) const {
+            cursor r;
+            if(type() != "array") return r;
+            each([&](const std::string&, const cursor& c) {
+                if(n-- > 0) return true;
+                r = c;
+                return false;
+            });
+            return r;
+        }
+        cursor cursor::find(const std::string& key) const {
+            cursor r;
+            if(type() != "object") return r;
+            each([&](const std::string& k, const cursor& c) {
+                if(k != key) return true;
+                r = c;
+                return false;
+            });
+            return r;
+        }
+        cursor cursor::pointer(const std::string& p) const {
+            std::vector<std::string> path;
+            if(!json_tape_internals::tokens(p, path)) return cursor();
+            cursor c = *this;
+            for(size_t i = 0; c && i < path.size(); i++) {
+                uint64_t n;
+                if(c.type() != "array") c = c.find(path[i]);
+                else if(json_tape_internals::index(path[i], n)) c = c.at(n);
+                else return cursor();
+            }
+            return c;
+        }
+        bool cursor::boolean() const {
+            return type() == "boolean" && d->in[offset()] == 't';
+        }
+        double cursor::number() const {
+            return type() == "number"? std::stod(text()) : 0;
+        }
+        std::string cursor::string() const {
+            if(type() != "string") return "";
+            std::string t = text();
+            return t.substr(1, t.size() - 2);
+        }
+        std::string cursor::text() const {
+            if(!*this) return "";
+            uint64_t w = d->tape[2 * i + 1];
+            uint64_t end = json_tape_internals::nested(w)? d->tape[2 * ((w >> 3) - 1)] + 1 : offset() + (w >> 3);
+            return std::string(d->in + offset(), end - offset());
+        }
+        std::shared_ptr<value> cursor::decode() const {
+            if(!*this) return nullptr;
+            return json::decode(text()).value;
+        }
+
+        document::document() {}
+        document::~document() {
+            close();
+        }
+        bool document::open(const std::string& input, const std::string& tape) {
+            using namespace json_tape_internals;
+            close();
+            mapping a, b;
+            if(!a.open(input) || !b.open(tape)) {
+                a.release();
+                b.release();
+                return false;
+            }
+            uint64_t bytes = 0;
+            if(b.n >= header) memcpy(&bytes, b.p + 8, 8);
+            if(b.n < header || memcmp(b.p, magic, 8) != 0 || bytes != a.n || (b.n - header) % 16 != 0) {
+                a.release();
+                b.release();
+                return false;
+            }
+            madvise(const_cast<char*>(a.p), a.n, MADV_RANDOM);
+            madvise(const_cast<char*>(b.p), b.n, MADV_RANDOM);
+            in = a.p;
+            in_bytes = a.n;
+            map = b.p;
+            map_bytes = b.n;
+            this->tape = reinterpret_cast<const uint64_t*>(b.p + header);
+            entries = (b.n - header) / 16;
+            return true;
+        }
+        void document::close() {
+            if(in) munmap(const_cast<char*>(in), in_bytes);
+            if(map) munmap(const_cast<char*>(map), map_bytes);
+            in = map = nullptr;
+            tape = nullptr;
+            in_bytes = map_bytes = 0;
+            entries = 0;
+        }
+        cursor document::root() const {
+            return cursor(this, 0);
+        }
+    };
+};
+
+#endif
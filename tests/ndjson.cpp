@@ -0,0 +1,168 @@
+// checks of json_ndjson.hpp, the round trip of records and the recovery from crashes,
+// a failed check prints its line and the run exits with 1
+// build: g++ -std=c++14 -O1 -pthread tests/ndjson.cpp -o json_ndjson_test
+// usage: json_ndjson_test [--dir /tmp]
+//        the stores are created and removed in dir
+
+#include "../json_ndjson.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+int failures = 0;
+#define CHECK(c) do { if(!(c)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c); failures++; } } while(0)
+
+std::string dir = "/tmp";
+
+std::string fresh(const std::string& name) { // a store path with no files left from an earlier run
+    std::string p = dir + "/" + name;
+    remove(p.c_str());
+    remove((p + ".idx").c_str());
+    return p;
+}
+void drop(const std::string& p) {
+    remove(p.c_str());
+    remove((p + ".idx").c_str());
+}
+
+// what append accepts is exactly what read returns, what it refuses is what decode could not read back
+void round_trip() {
+    std::string p = fresh("json_ndjson_round_trip");
+    json::ndjson::store st;
+    CHECK(st.open(p));
+    std::vector<std::shared_ptr<json::value>> kept = {
+        json::number(0),
+        json::number(2.5),
+        json::string(""),
+        json::string("say \\\"hi\\\""),     // escapes are held as written
+        json::string("C:\\\\"),
+        json::string("two\nlines\r"),         // raw line breaks are escaped by encode_line
+        json::array({ json::boolean(true), json::object({ { "k\\\"ey", json::string("v") } }) })
+    };
+    std::vector<std::shared_ptr<json::value>> refused = {
+        json::number(-1),
+        json::number(-0.0),
+        json::number(NAN),
+        json::number(INFINITY),
+        json::string("say \"hi\""),           // a raw quote ends the string
+        json::string("C:\\"),                 // a trailing backslash swallows the quote
+        json::string("a\\\\\"b"),             // the quote after an escaped backslash is raw
+        json::string("tab\there"),
+        json::string(std::string("nul\0", 4)),
+        json::array({ nullptr }),
+        json::object({ { "k\"ey", json::number(1) } }),
+        json::object({ { "ok", json::array({ json::string("\x01") }) } })
+    };
+    for(auto& v : refused) CHECK(st.append(v) == ~0ull);
+    for(size_t i = 0; i < kept.size(); i++) {
+        CHECK(st.append(kept[i]) == i);
+    }
+    CHECK(st.commit());
+    CHECK(st.size() == kept.size());
+    for(size_t i = 0; i < kept.size(); i++) {
+        std::shared_ptr<json::value> v = st.read(i);
+        CHECK(v && json::encode_line(v) == json::encode_line(json::decode(json::encode_line(kept[i])).value));
+    }
+    st.close();
+    drop(p);
+}
+
+// a store left as a crash could leave it, by editing its files, reopens with every complete record and nothing else
+struct crash {
+    std::string p;
+    std::vector<std::string> lines;
+    std::vector<uint64_t> ends;
+    crash(const std::string& name) : p(fresh(name)) {
+        json::ndjson::store st;
+        CHECK(st.open(p));
+        for(int i = 0; i < 5; i++) {
+            std::shared_ptr<json::value> v = json::object({ { "n", json::number(i) }, { "s", json::string(std::string(i + 1, 'x')) } });
+            CHECK(st.append(v) == (uint64_t)i);
+            lines.push_back(json::encode_line(v));
+            ends.push_back((ends.empty()? 0 : ends.back()) + lines.back().size() + 1);
+        }
+        st.close();
+    }
+    ~crash() {
+        drop(p);
+    }
+    void index(const std::vector<uint64_t>& words) {
+        FILE* f = fopen((p + ".idx").c_str(), "wb");
+        if(!words.empty()) fwrite(words.data(), 8, words.size(), f);
+        fclose(f);
+    }
+    void data(const std::string& bytes, bool append) {
+        FILE* f = fopen(p.c_str(), append? "ab" : "wb");
+        fwrite(bytes.data(), 1, bytes.size(), f);
+        fclose(f);
+    }
+    std::string all(size_t n) const {
+        std::string r;
+        for(size_t i = 0; i < n; i++) r += lines[i] + "\n";
+        return r;
+    }
+    void reopens_with(size_t n) { // the first n records, then appends continue after them
+        json::ndjson::store st;
+        CHECK(st.open(p));
+        CHECK(st.size() == n);
+        for(size_t i = 0; i < n; i++) CHECK(st.line(i) == lines[i] && st.read(i));
+        CHECK(st.line(n) == "");
+        CHECK(st.append(json::string("after")) == n);
+        CHECK(st.commit());
+        CHECK(st.line(n) == "\"after\"");
+        st.close();
+        FILE* f = fopen((p + ".idx").c_str(), "rb");
+        fseek(f, 0, SEEK_END);
+        CHECK(ftell(f) == (long)(8 * (n + 1)));
+        fclose(f);
+    }
+};
+void recovery() {
+    {
+        crash c("json_ndjson_zero_tail"); // the index file grew but its last pages never reached the disk
+        std::vector<uint64_t> w = c.ends;
+        w.resize(11, 0);
+        c.index(w);
+        c.reopens_with(5);
+    }
+    {
+        crash c("json_ndjson_zero_hole"); // a page in the middle of the last group was lost
+        c.index({ c.ends[0], c.ends[1], 0, c.ends[3], c.ends[4] });
+        c.reopens_with(5);
+    }
+    {
+        crash c("json_ndjson_stale_word"); // in range and increasing, but not the end of a line
+        c.index({ c.ends[0], c.ends[1], c.ends[2], c.ends[3], c.ends[4] - 2 });
+        c.reopens_with(5);
+    }
+    {
+        crash c("json_ndjson_unindexed"); // the data was synced, the index write never happened
+        c.index({ c.ends[0], c.ends[1] });
+        c.reopens_with(5);
+    }
+    {
+        crash c("json_ndjson_torn_line"); // a record cut in the middle of its write
+        c.data("{\"n\":5,\"s\":\"xx", true);
+        c.reopens_with(5);
+    }
+    {
+        crash c("json_ndjson_lost_data"); // the index points past data that did not survive
+        c.data(c.all(3) + c.lines[3].substr(0, 4), false);
+        c.reopens_with(3);
+    }
+    {
+        crash c("json_ndjson_empty_index");
+        c.index({});
+        c.reopens_with(5);
+    }
+}
+
+int main(int argc, char** argv) {
+    for(int i = 1; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "--dir") == 0) dir = argv[i + 1];
+    }
+    round_trip();
+    recovery();
+    fprintf(stderr, failures? "%d checks failed\n" : "ok\n", failures);
+    return failures? 1 : 0;
+}